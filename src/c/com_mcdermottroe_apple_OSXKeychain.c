@@ -27,10 +27,27 @@
 #include <Security/Security.h>
 
 #include "com_mcdermottroe_apple_OSXKeychain.h"
+#include <libkern/OSAtomic.h>
+#include <mach/mach.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 
 #define OSXKeychainException "com/mcdermottroe/apple/OSXKeychainException"
+#define OSXKeychainEvent "com/mcdermottroe/apple/OSXKeychainEvent"
+#define OSXKeychainEventConstructor "(ILjava/lang/String;Ljava/lang/String;Ljava/lang/String;)V"
+#define OSXKeychainItemMetadata "com/mcdermottroe/apple/OSXKeychainItemMetadata"
+#define OSXKeychainItemMetadataConstructor "(ZLjava/lang/String;Ljava/lang/String;Ljava/lang/String;IIJ)V"
+
+/* The event types passed to the OSXKeychainEvent constructor. These must be
+ * kept in sync with the order of OSXKeychainEvent.Type.
+ */
+#define KEYCHAIN_EVENT_ADDED	0
+#define KEYCHAIN_EVENT_UPDATED	1
+#define KEYCHAIN_EVENT_DELETED	2
 
 /* A simplified structure for dealing with jstring objects. Use jstring_unpack
  * and jstring_unpacked_free to manage these.
@@ -157,33 +174,24 @@ JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1addGenericPassw
 	jstring_unpacked_free(env, password, &service_password);
 }
 
-JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1modifyGenericPassword(JNIEnv *env, jobject obj, jstring serviceName, jstring accountName, jstring password) {
+/* Find a generic password and replace its contents.
+ *
+ * Parameters:
+ *	env				The JNI environment.
+ *	service_name	The service name of the password to modify.
+ *	account_name	The account name of the password to modify.
+ *	password		The new password.
+ */
+static void modify_generic_password(JNIEnv* env, const jstring_unpacked* service_name, const jstring_unpacked* account_name, const jstring_unpacked* password) {
 	OSStatus status;
-	jstring_unpacked service_name;
-	jstring_unpacked account_name;
-	jstring_unpacked service_password;
 	SecKeychainItemRef existingItem;
 
-	/* Unpack the params */
-	jstring_unpack(env, serviceName, &service_name);
-	jstring_unpack(env, accountName, &account_name);
-	jstring_unpack(env, password, &service_password);
-	/* check for allocation failures */
-	if (service_name.str == NULL || 
-	    account_name.str == NULL || 
-		service_password.str == NULL) {
-		jstring_unpacked_free(env, serviceName, &service_name);
-		jstring_unpacked_free(env, accountName, &account_name);
-		jstring_unpacked_free(env, password, &service_password);
-		return;
-	}
-
 	status = SecKeychainFindGenericPassword(
 		NULL,
-		service_name.len,
-		service_name.str,
-		account_name.len,
-		account_name.str,
+		service_name->len,
+		service_name->str,
+		account_name->len,
+		account_name->str,
 		NULL,
 		NULL,
 		&existingItem
@@ -196,13 +204,39 @@ JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1modifyGenericPa
 		status = SecKeychainItemModifyContent(
 			existingItem,
 			NULL,
-			service_password.len,
-			service_password.str
+			password->len,
+			password->str
 		);
+		CFRelease(existingItem);
 		if (status != errSecSuccess) {
 			throw_osxkeychainexception(env, status);
 		}
 	}
+}
+
+/* Implementation of OSXKeychain.modifyGenericPassword(). See the Java docs
+ * for explanations of the parameters.
+ */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1modifyGenericPassword(JNIEnv *env, jobject obj, jstring serviceName, jstring accountName, jstring password) {
+	jstring_unpacked service_name;
+	jstring_unpacked account_name;
+	jstring_unpacked service_password;
+
+	/* Unpack the params */
+	jstring_unpack(env, serviceName, &service_name);
+	jstring_unpack(env, accountName, &account_name);
+	jstring_unpack(env, password, &service_password);
+	/* check for allocation failures */
+	if (service_name.str == NULL || 
+	    account_name.str == NULL || 
+		service_password.str == NULL) {
+		jstring_unpacked_free(env, serviceName, &service_name);
+		jstring_unpacked_free(env, accountName, &account_name);
+		jstring_unpacked_free(env, password, &service_password);
+		return;
+	}
+
+	modify_generic_password(env, &service_name, &account_name, &service_password);
 
 	/* Clean up. */
 	jstring_unpacked_free(env, serviceName, &service_name);
@@ -272,14 +306,47 @@ JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1addInternetPass
 	jstring_unpacked_free(env, password, &server_password);
 }
 
-/* Implementation of OSXKeychain.findGenericPassword(). See the Java docs for
- * explanations of the parameters.
+/* Turn a password returned by one of the SecKeychainFind*Password functions
+ * into a jstring and free the keychain's copy.
+ *
+ * Parameters:
+ *	env				The JNI environment.
+ *	password		The password data from the keychain.
+ *	password_length	The length of the password data.
+ *
+ * Returns: The password as a jstring.
  */
-JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPassword(JNIEnv* env, jobject obj, jstring serviceName, jstring accountName) {
+static jstring keychain_password_to_jstring(JNIEnv* env, void* password, UInt32 password_length) {
+	jstring result;
+
+	// the returned value from keychain is not 
+	// null terminated, so a copy is created. 
+	char* password_buffer = (char *) malloc(password_length+1);
+	memcpy(password_buffer, password, password_length);
+	password_buffer[password_length] = 0;
+
+	/* Create the return value. */
+	result = (*env)->NewStringUTF(env, password_buffer);
+
+	/* Clean up. */
+	bzero(password_buffer, password_length);
+	free(password_buffer);
+	SecKeychainItemFreeContent(NULL, password);
+
+	return result;
+}
+
+/* Look up a generic password in the user's keychain.
+ *
+ * Parameters:
+ *	env				The JNI environment.
+ *	service_name	The service name of the password.
+ *	account_name	The account name of the password.
+ *
+ * Returns: The password or NULL if an exception has been thrown.
+ */
+static jstring find_generic_password(JNIEnv* env, const jstring_unpacked* service_name, const jstring_unpacked* account_name) {
 	OSStatus status;
-	jstring_unpacked service_name;
-	jstring_unpacked account_name;
-	jstring result = NULL;
 
 	/* Buffer for the return from SecKeychainFindGenericPassword. */
 	void* password;
@@ -292,60 +359,63 @@ JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findGenericP
 		return NULL;
 	}
 
-	/* Unpack the params. */
-	jstring_unpack(env, serviceName, &service_name);
-	jstring_unpack(env, accountName, &account_name);
-	if (service_name.str == NULL || 
-	    account_name.str == NULL) {
-		jstring_unpacked_free(env, serviceName, &service_name);
-		jstring_unpacked_free(env, accountName, &account_name);
-		return NULL;
-	}
-	
 	status = SecKeychainFindGenericPassword(
 		NULL,
-		service_name.len,
-		service_name.str,
-		account_name.len,
-		account_name.str,
+		service_name->len,
+		service_name->str,
+		account_name->len,
+		account_name->str,
 		&password_length,
 		&password,
 		NULL
 	);
 	if (status != errSecSuccess) {
 		throw_osxkeychainexception(env, status);
+		return NULL;
 	}
-	else {
-		// the returned value from keychain is not 
-		// null terminated, so a copy is created. 
-		char *password_buffer = malloc(password_length+1);
-		memcpy(password_buffer, password, password_length);
-		password_buffer[password_length] = 0;
+	return keychain_password_to_jstring(env, password, password_length);
+}
 
-		/* Create the return value. */
-		result = (*env)->NewStringUTF(env, password_buffer);
+/* Implementation of OSXKeychain.findGenericPassword(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPassword(JNIEnv* env, jobject obj, jstring serviceName, jstring accountName) {
+	jstring_unpacked service_name;
+	jstring_unpacked account_name;
+	jstring result = NULL;
 
-		/* Clean up. */
-		bzero(password_buffer, password_length);
-		free(password_buffer);
-		SecKeychainItemFreeContent(NULL, password);
+	/* Unpack the params. */
+	jstring_unpack(env, serviceName, &service_name);
+	jstring_unpack(env, accountName, &account_name);
+	if (service_name.str == NULL || 
+	    account_name.str == NULL) {
+		jstring_unpacked_free(env, serviceName, &service_name);
+		jstring_unpacked_free(env, accountName, &account_name);
+		return NULL;
 	}
+
+	result = find_generic_password(env, &service_name, &account_name);
+
 	jstring_unpacked_free(env, serviceName, &service_name);
 	jstring_unpacked_free(env, accountName, &account_name);
 
 	return result;
 }
 
-/* Implementation of OSXKeychain.findInternetPassword(). See the Java docs for
- * explanations of the parameters.
+/* Look up an internet password in the user's keychain.
+ *
+ * Parameters:
+ *	env				The JNI environment.
+ *	server_name		The server the password is for.
+ *	security_domain	The security domain of the password.
+ *	account_name	The account name of the password.
+ *	server_path		The path on the server.
+ *	port			The port on the server, or 0 for any port.
+ *
+ * Returns: The password or NULL if an exception has been thrown.
  */
-JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findInternetPassword(JNIEnv* env, jobject obj, jstring serverName, jstring securityDomain, jstring accountName, jstring path, jint port) {
+static jstring find_internet_password(JNIEnv* env, const jstring_unpacked* server_name, const jstring_unpacked* security_domain, const jstring_unpacked* account_name, const jstring_unpacked* server_path, UInt16 port) {
 	OSStatus status;
-	jstring_unpacked server_name;
-	jstring_unpacked security_domain;
-	jstring_unpacked account_name;
-	jstring_unpacked server_path;
-	jstring result = NULL;
 
 	/* This is the password buffer which will be used by
 	 * SecKeychainFindInternetPassword
@@ -360,6 +430,40 @@ JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findInternet
 		return NULL;
 	}
 
+	status = SecKeychainFindInternetPassword(
+		NULL,
+		server_name->len,
+		server_name->str,
+		security_domain->len,
+		security_domain->str,
+		account_name->len,
+		account_name->str,
+		server_path->len,
+		server_path->str,
+		port,
+		kSecProtocolTypeAny,
+		kSecAuthenticationTypeAny,
+		&password_length,
+		&password,
+		NULL
+	);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+		return NULL;
+	}
+	return keychain_password_to_jstring(env, password, password_length);
+}
+
+/* Implementation of OSXKeychain.findInternetPassword(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findInternetPassword(JNIEnv* env, jobject obj, jstring serverName, jstring securityDomain, jstring accountName, jstring path, jint port) {
+	jstring_unpacked server_name;
+	jstring_unpacked security_domain;
+	jstring_unpacked account_name;
+	jstring_unpacked server_path;
+	jstring result = NULL;
+
 	/* Unpack all the jstrings into useful structures. */
 	jstring_unpack(env, serverName, &server_name);
 	jstring_unpack(env, securityDomain, &security_domain);
@@ -376,41 +480,7 @@ JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findInternet
 		return NULL;
 	}
 
-	status = SecKeychainFindInternetPassword(
-		NULL,
-		server_name.len,
-		server_name.str,
-		security_domain.len,
-		security_domain.str,
-		account_name.len,
-		account_name.str,
-		server_path.len,
-		server_path.str,
-		port,
-		kSecProtocolTypeAny,
-		kSecAuthenticationTypeAny,
-		&password_length,
-		&password,
-		NULL
-	);
-	if (status != errSecSuccess) {
-		throw_osxkeychainexception(env, status);
-	}
-	else {
-		// the returned value from keychain is not 
-		// null terminated, so a copy is created. 
-		char* password_buffer = (char *) malloc(password_length+1);
-		memcpy(password_buffer, password, password_length);
-		password_buffer[password_length] = 0;
-		
-		/* Create the return value. */
-		result = (*env)->NewStringUTF(env, password_buffer);
-
-		/* Clean up. */
-		bzero(password_buffer, password_length);
-		free(password_buffer);
-		SecKeychainItemFreeContent(NULL, password);
-	}
+	result = find_internet_password(env, &server_name, &security_domain, &account_name, &server_path, port);
 
 	jstring_unpacked_free(env, serverName, &server_name);
 	jstring_unpacked_free(env, securityDomain, &security_domain);
@@ -420,13 +490,15 @@ JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findInternet
 	return result;
 }
 
-/* Implementation of OSXKeychain.deleteGenericPassword(). See the Java docs for
- * explanations of the parameters.
+/* Find a generic password and delete it from the keychain.
+ *
+ * Parameters:
+ *	env				The JNI environment.
+ *	service_name	The service name of the password to delete.
+ *	account_name	The account name of the password to delete.
  */
-JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPassword(JNIEnv* env, jobject obj, jstring serviceName, jstring accountName) {
+static void delete_generic_password(JNIEnv* env, const jstring_unpacked* service_name, const jstring_unpacked* account_name) {
 	OSStatus status;
-	jstring_unpacked service_name;
-	jstring_unpacked account_name;
 	SecKeychainItemRef itemToDelete;
 
 	/* Query the keychain. */
@@ -436,21 +508,12 @@ JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPa
 		return;
 	}
 
-	/* Unpack the params. */
-	jstring_unpack(env, serviceName, &service_name);
-	jstring_unpack(env, accountName, &account_name);
-	if (service_name.str == NULL || 
-	    account_name.str == NULL) {
-		jstring_unpacked_free(env, serviceName, &service_name);
-		jstring_unpacked_free(env, accountName, &account_name);
-		return;
-	}
 	status = SecKeychainFindGenericPassword(
 		NULL,
-		service_name.len,
-		service_name.str,
-		account_name.len,
-		account_name.str,
+		service_name->len,
+		service_name->str,
+		account_name->len,
+		account_name->str,
 		NULL,
 		NULL,
 		&itemToDelete
@@ -460,12 +523,1255 @@ JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPa
 	}
 	else {
 		status = SecKeychainItemDelete(itemToDelete);
+		CFRelease(itemToDelete);
 		if (status != errSecSuccess) {
 			throw_osxkeychainexception(env, status);
 		}
 	}
+}
+
+/* Implementation of OSXKeychain.deleteGenericPassword(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPassword(JNIEnv* env, jobject obj, jstring serviceName, jstring accountName) {
+	jstring_unpacked service_name;
+	jstring_unpacked account_name;
+
+	/* Unpack the params. */
+	jstring_unpack(env, serviceName, &service_name);
+	jstring_unpack(env, accountName, &account_name);
+	if (service_name.str == NULL || 
+	    account_name.str == NULL) {
+		jstring_unpacked_free(env, serviceName, &service_name);
+		jstring_unpacked_free(env, accountName, &account_name);
+		return;
+	}
+
+	delete_generic_password(env, &service_name, &account_name);
 
 	/* Clean up. */
 	jstring_unpacked_free(env, serviceName, &service_name);
 	jstring_unpacked_free(env, accountName, &account_name);
 }
+
+/* A single change to the keychain, waiting to be delivered to Java. All of
+ * the strings are NUL-terminated copies owned by the event and any of them
+ * may be NULL if the keychain didn't tell us that attribute.
+ */
+typedef struct keychain_event {
+	struct keychain_event* next;
+	int type;
+	char* service_name;
+	char* account_name;
+	char* server_name;
+} keychain_event;
+
+/* The queue of keychain events. Any number of threads may push onto
+ * keychain_event_head using compare-and-swap, so it's in LIFO order. The
+ * single consumer detaches the whole list in one swap and reverses it into
+ * keychain_event_pending which is only ever touched by the consumer.
+ */
+static keychain_event* volatile keychain_event_head = NULL;
+static keychain_event* keychain_event_pending = NULL;
+
+/* Signalled once for every event pushed so that the consumer can sleep while
+ * the queue is empty.
+ */
+static semaphore_t keychain_event_semaphore;
+static pthread_once_t keychain_event_once = PTHREAD_ONCE_INIT;
+
+/* State for the thread which owns the keychain callback. */
+static volatile int32_t keychain_events_started = 0;
+static semaphore_t keychain_events_startup_semaphore;
+static OSStatus keychain_events_startup_status;
+
+/* Set up the semaphores used by the event queue. Call this via pthread_once
+ * using keychain_event_once.
+ */
+static void keychain_event_init(void) {
+	semaphore_create(mach_task_self(), &keychain_event_semaphore, SYNC_POLICY_FIFO, 0);
+	semaphore_create(mach_task_self(), &keychain_events_startup_semaphore, SYNC_POLICY_FIFO, 0);
+}
+
+/* Make a NUL-terminated copy of a keychain attribute value.
+ *
+ * Parameters:
+ *	data	The attribute data, may be NULL.
+ *	len		The length of the attribute data.
+ *
+ * Returns: A malloc'd copy of the data or NULL if there was no data or the
+ *			allocation failed.
+ */
+static char* copy_attribute_string(const void* data, UInt32 len) {
+	char* ret;
+
+	if (data == NULL || len == 0) {
+		return NULL;
+	}
+	ret = malloc(len + 1);
+	if (ret != NULL) {
+		memcpy(ret, data, len);
+		ret[len] = 0;
+	}
+	return ret;
+}
+
+/* Free a keychain_event and everything it owns.
+ *
+ * Parameters:
+ *	event	The event to free.
+ */
+static void keychain_event_free(keychain_event* event) {
+	free(event->service_name);
+	free(event->account_name);
+	free(event->server_name);
+	free(event);
+}
+
+/* Push a keychain event onto the queue and wake up the consumer. This is the
+ * only way events get into the queue so tests can use it to simulate the
+ * keychain callback.
+ *
+ * Parameters:
+ *	type			One of the KEYCHAIN_EVENT_* constants.
+ *	service_name	The service name of a generic password, or NULL.
+ *	service_len		The length of service_name.
+ *	account_name	The account name of the item, or NULL.
+ *	account_len		The length of account_name.
+ *	server_name		The server name of an internet password, or NULL.
+ *	server_len		The length of server_name.
+ */
+void keychain_event_post(int type, const void* service_name, UInt32 service_len, const void* account_name, UInt32 account_len, const void* server_name, UInt32 server_len) {
+	keychain_event* event;
+	keychain_event* head;
+
+	pthread_once(&keychain_event_once, keychain_event_init);
+
+	event = malloc(sizeof(keychain_event));
+	if (event == NULL) {
+		return;
+	}
+	event->type = type;
+	event->service_name = copy_attribute_string(service_name, service_len);
+	event->account_name = copy_attribute_string(account_name, account_len);
+	event->server_name = copy_attribute_string(server_name, server_len);
+
+	do {
+		head = keychain_event_head;
+		event->next = head;
+	} while (!OSAtomicCompareAndSwapPtrBarrier(head, event, (void* volatile*)&keychain_event_head));
+	semaphore_signal(keychain_event_semaphore);
+}
+
+/* Take the oldest event from the queue. Only one thread may call this at a
+ * time.
+ *
+ * Parameters:
+ *	timeout	The maximum number of milliseconds to wait for an event if the
+ *			queue is empty.
+ *
+ * Returns: The event, which the caller must free with keychain_event_free,
+ *			or NULL if there was no event within the timeout.
+ */
+static keychain_event* keychain_event_take(long long timeout) {
+	keychain_event* detached;
+	keychain_event* event;
+	mach_timespec_t wait;
+
+	pthread_once(&keychain_event_once, keychain_event_init);
+
+	while (keychain_event_pending == NULL) {
+		/* Detach everything which has been pushed so far. */
+		do {
+			detached = keychain_event_head;
+		} while (!OSAtomicCompareAndSwapPtrBarrier(detached, NULL, (void* volatile*)&keychain_event_head));
+
+		/* Reverse it so that the events are delivered in order. */
+		while (detached != NULL) {
+			event = detached;
+			detached = detached->next;
+			event->next = keychain_event_pending;
+			keychain_event_pending = event;
+		}
+
+		if (keychain_event_pending == NULL) {
+			if (timeout <= 0) {
+				return NULL;
+			}
+			wait.tv_sec = (unsigned int)(timeout / 1000);
+			wait.tv_nsec = (int)((timeout % 1000) * 1000000);
+			if (semaphore_timedwait(keychain_event_semaphore, wait) != KERN_SUCCESS) {
+				return NULL;
+			}
+			/* Wait at most once, a stale signal may have woken us. */
+			timeout = 0;
+		}
+	}
+
+	event = keychain_event_pending;
+	keychain_event_pending = event->next;
+	event->next = NULL;
+	return event;
+}
+
+/* The callback registered with SecKeychainAddCallback. It records the names
+ * of the item that changed and queues an event for the Java side.
+ *
+ * Parameters:
+ *	keychainEvent	The type of event which occurred.
+ *	info			Details of the event, including the item affected.
+ *	context			Unused.
+ *
+ * Returns: errSecSuccess, always.
+ */
+static OSStatus keychain_callback(SecKeychainEvent keychainEvent, SecKeychainCallbackInfo* info, void* context) {
+	int type;
+	OSStatus status;
+	SecItemClass item_class;
+	SecKeychainAttribute attrs[2];
+	SecKeychainAttributeList attr_list;
+
+	switch (keychainEvent) {
+		case kSecAddEvent:
+			type = KEYCHAIN_EVENT_ADDED;
+			break;
+		case kSecUpdateEvent:
+			type = KEYCHAIN_EVENT_UPDATED;
+			break;
+		case kSecDeleteEvent:
+			type = KEYCHAIN_EVENT_DELETED;
+			break;
+		default:
+			return errSecSuccess;
+	}
+
+	/* A deleted item usually can't be read any more, so the event goes out
+	 * without any names and listeners must assume anything may have changed.
+	 */
+	if (info == NULL || info->item == NULL) {
+		keychain_event_post(type, NULL, 0, NULL, 0, NULL, 0);
+		return errSecSuccess;
+	}
+	status = SecKeychainItemCopyContent(info->item, &item_class, NULL, NULL, NULL);
+	if (status != errSecSuccess) {
+		keychain_event_post(type, NULL, 0, NULL, 0, NULL, 0);
+		return errSecSuccess;
+	}
+
+	/* Fetch the names which identify the item. */
+	attrs[0].tag = item_class == kSecInternetPasswordItemClass ? kSecServerItemAttr : kSecServiceItemAttr;
+	attrs[0].length = 0;
+	attrs[0].data = NULL;
+	attrs[1].tag = kSecAccountItemAttr;
+	attrs[1].length = 0;
+	attrs[1].data = NULL;
+	attr_list.count = 2;
+	attr_list.attr = attrs;
+	status = SecKeychainItemCopyContent(info->item, NULL, &attr_list, NULL, NULL);
+	if (status != errSecSuccess) {
+		keychain_event_post(type, NULL, 0, NULL, 0, NULL, 0);
+		return errSecSuccess;
+	}
+
+	if (item_class == kSecInternetPasswordItemClass) {
+		keychain_event_post(type, NULL, 0, attrs[1].data, attrs[1].length, attrs[0].data, attrs[0].length);
+	} else {
+		keychain_event_post(type, attrs[0].data, attrs[0].length, attrs[1].data, attrs[1].length, NULL, 0);
+	}
+	SecKeychainItemFreeContent(&attr_list, NULL);
+
+	return errSecSuccess;
+}
+
+/* The body of the thread which owns the keychain callback. The callback is
+ * delivered via the run loop of the thread which registered it and the JVM
+ * threads don't run one, so this thread exists to do that.
+ *
+ * Parameters:
+ *	arg	Unused.
+ *
+ * Returns: NULL, if the callback could not be registered. Otherwise this
+ *			never returns.
+ */
+static void* keychain_event_thread(void* arg) {
+	keychain_events_startup_status = SecKeychainAddCallback(
+		keychain_callback,
+		kSecAddEventMask | kSecUpdateEventMask | kSecDeleteEventMask,
+		NULL
+	);
+	semaphore_signal(keychain_events_startup_semaphore);
+	if (keychain_events_startup_status == errSecSuccess) {
+		CFRunLoopRun();
+	}
+	return NULL;
+}
+
+/* Implementation of OSXKeychain._startKeychainEvents(). Registers the
+ * keychain callback the first time it's called and does nothing after that.
+ */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1startKeychainEvents(JNIEnv* env, jobject obj) {
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	if (!OSAtomicCompareAndSwap32Barrier(0, 1, &keychain_events_started)) {
+		return;
+	}
+	pthread_once(&keychain_event_once, keychain_event_init);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, keychain_event_thread, NULL) != 0) {
+		pthread_attr_destroy(&attr);
+		keychain_events_started = 0;
+		throw_exception(env, OSXKeychainException, "Failed to start the keychain event thread.");
+		return;
+	}
+	pthread_attr_destroy(&attr);
+
+	/* Wait for the callback to be registered so errors can be reported. */
+	semaphore_wait(keychain_events_startup_semaphore);
+	if (keychain_events_startup_status != errSecSuccess) {
+		keychain_events_started = 0;
+		throw_osxkeychainexception(env, keychain_events_startup_status);
+	}
+}
+
+/* Implementation of OSXKeychain._takeKeychainEvent(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT jobject JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1takeKeychainEvent(JNIEnv* env, jobject obj, jlong timeout) {
+	keychain_event* event;
+	jclass cls;
+	jmethodID constructor;
+	jstring service_name = NULL;
+	jstring account_name = NULL;
+	jstring server_name = NULL;
+	jobject result = NULL;
+
+	event = keychain_event_take(timeout);
+	if (event == NULL) {
+		return NULL;
+	}
+
+	cls = (*env)->FindClass(env, OSXKeychainEvent);
+	if (cls == NULL) {
+		keychain_event_free(event);
+		return NULL;
+	}
+	constructor = (*env)->GetMethodID(env, cls, "<init>", OSXKeychainEventConstructor);
+	if (constructor != NULL) {
+		if (event->service_name != NULL) {
+			service_name = (*env)->NewStringUTF(env, event->service_name);
+		}
+		if (event->account_name != NULL) {
+			account_name = (*env)->NewStringUTF(env, event->account_name);
+		}
+		if (event->server_name != NULL) {
+			server_name = (*env)->NewStringUTF(env, event->server_name);
+		}
+		result = (*env)->NewObject(env, cls, constructor, (jint)event->type, service_name, account_name, server_name);
+	}
+
+	/* Clean up. */
+	(*env)->DeleteLocalRef(env, cls);
+	keychain_event_free(event);
+
+	return result;
+}
+
+/* The indices of the fields in a prepared_key for each kind of password. */
+#define PREPARED_GENERIC_SERVICE	0
+#define PREPARED_GENERIC_ACCOUNT	1
+#define PREPARED_GENERIC_FIELDS		2
+#define PREPARED_INTERNET_SERVER	0
+#define PREPARED_INTERNET_DOMAIN	1
+#define PREPARED_INTERNET_ACCOUNT	2
+#define PREPARED_INTERNET_PATH		3
+#define PREPARED_INTERNET_FIELDS	4
+
+/* The identifying fields of a password, converted to UTF-8 once so that they
+ * can be used for any number of lookups. The strings live in the same
+ * allocation, directly after the struct, so a single free releases it all.
+ * Each string is NUL-terminated. Every field of a key is non-empty, because
+ * the keychain treats an empty field as matching any item.
+ */
+typedef struct {
+	UInt16 port;
+	jstring_unpacked fields[PREPARED_INTERNET_FIELDS];
+} prepared_key;
+
+/* Create a prepared_key from a set of jstrings.
+ *
+ * Parameters:
+ *	env		The JNI environment.
+ *	strings	The values for the fields. An OSXKeychainException is thrown if
+ *			any of them is NULL or empty.
+ *	count	The number of entries in strings.
+ *	port	The port number, for internet passwords.
+ *
+ * Returns: The key as a jlong, or 0 if an exception has been thrown.
+ */
+static jlong prepared_key_new(JNIEnv* env, jstring* strings, int count, UInt16 port) {
+	prepared_key* key;
+	char* buffer;
+	size_t total = 0;
+	int lengths[PREPARED_INTERNET_FIELDS];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		lengths[i] = strings[i] == NULL ? 0 : (int)((*env)->GetStringUTFLength(env, strings[i]));
+		if (lengths[i] <= 0) {
+			throw_exception(env, OSXKeychainException, "Prepared keys must not have null or empty fields.");
+			return 0;
+		}
+		/* Room for a terminating NUL. Some JVMs write one after the
+		 * region, and the field must be terminated either way.
+		 */
+		total += lengths[i] + 1;
+	}
+
+	key = malloc(sizeof(prepared_key) + total);
+	if (key == NULL) {
+		throw_exception(env, OSXKeychainException, "Failed to allocate a prepared key.");
+		return 0;
+	}
+	key->port = port;
+
+	/* Copy the UTF-8 straight into the key, no intermediate copies. */
+	buffer = (char*)(key + 1);
+	for (i = 0; i < PREPARED_INTERNET_FIELDS; i++) {
+		if (i >= count) {
+			key->fields[i].len = 0;
+			key->fields[i].str = NULL;
+			continue;
+		}
+		(*env)->GetStringUTFRegion(env, strings[i], 0, (*env)->GetStringLength(env, strings[i]), buffer);
+		buffer[lengths[i]] = '\0';
+		key->fields[i].len = lengths[i];
+		key->fields[i].str = buffer;
+		buffer += lengths[i] + 1;
+	}
+
+	return (jlong)(intptr_t)key;
+}
+
+/* Implementation of OSXKeychain._prepareGenericKey(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT jlong JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1prepareGenericKey(JNIEnv* env, jobject obj, jstring serviceName, jstring accountName) {
+	jstring strings[PREPARED_GENERIC_FIELDS];
+
+	strings[PREPARED_GENERIC_SERVICE] = serviceName;
+	strings[PREPARED_GENERIC_ACCOUNT] = accountName;
+	return prepared_key_new(env, strings, PREPARED_GENERIC_FIELDS, 0);
+}
+
+/* Implementation of OSXKeychain._prepareInternetKey(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT jlong JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1prepareInternetKey(JNIEnv* env, jobject obj, jstring serverName, jstring securityDomain, jstring accountName, jstring path, jint port) {
+	jstring strings[PREPARED_INTERNET_FIELDS];
+
+	strings[PREPARED_INTERNET_SERVER] = serverName;
+	strings[PREPARED_INTERNET_DOMAIN] = securityDomain;
+	strings[PREPARED_INTERNET_ACCOUNT] = accountName;
+	strings[PREPARED_INTERNET_PATH] = path;
+	return prepared_key_new(env, strings, PREPARED_INTERNET_FIELDS, (UInt16)port);
+}
+
+/* Implementation of OSXKeychain._freePreparedKey(). */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1freePreparedKey(JNIEnv* env, jclass cls, jlong key) {
+	free((prepared_key*)(intptr_t)key);
+}
+
+/* Implementation of OSXKeychain._findGenericPasswordPrepared(). See the Java
+ * docs for explanations of the parameters.
+ */
+JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPasswordPrepared(JNIEnv* env, jobject obj, jlong key) {
+	prepared_key* k = (prepared_key*)(intptr_t)key;
+
+	return find_generic_password(
+		env,
+		&k->fields[PREPARED_GENERIC_SERVICE],
+		&k->fields[PREPARED_GENERIC_ACCOUNT]
+	);
+}
+
+/* Implementation of OSXKeychain._modifyGenericPasswordPrepared(). See the
+ * Java docs for explanations of the parameters.
+ */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1modifyGenericPasswordPrepared(JNIEnv* env, jobject obj, jlong key, jstring password) {
+	prepared_key* k = (prepared_key*)(intptr_t)key;
+	jstring_unpacked service_password;
+
+	jstring_unpack(env, password, &service_password);
+	if (service_password.str == NULL) {
+		return;
+	}
+
+	modify_generic_password(
+		env,
+		&k->fields[PREPARED_GENERIC_SERVICE],
+		&k->fields[PREPARED_GENERIC_ACCOUNT],
+		&service_password
+	);
+
+	jstring_unpacked_free(env, password, &service_password);
+}
+
+/* Implementation of OSXKeychain._deleteGenericPasswordPrepared(). See the
+ * Java docs for explanations of the parameters.
+ */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPasswordPrepared(JNIEnv* env, jobject obj, jlong key) {
+	prepared_key* k = (prepared_key*)(intptr_t)key;
+
+	delete_generic_password(
+		env,
+		&k->fields[PREPARED_GENERIC_SERVICE],
+		&k->fields[PREPARED_GENERIC_ACCOUNT]
+	);
+}
+
+/* Implementation of OSXKeychain._findInternetPasswordPrepared(). See the
+ * Java docs for explanations of the parameters.
+ */
+JNIEXPORT jstring JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1findInternetPasswordPrepared(JNIEnv* env, jobject obj, jlong key) {
+	prepared_key* k = (prepared_key*)(intptr_t)key;
+
+	return find_internet_password(
+		env,
+		&k->fields[PREPARED_INTERNET_SERVER],
+		&k->fields[PREPARED_INTERNET_DOMAIN],
+		&k->fields[PREPARED_INTERNET_ACCOUNT],
+		&k->fields[PREPARED_INTERNET_PATH],
+		k->port
+	);
+}
+
+/* Compare two buffers in time which depends only on the length of the first,
+ * so that the time taken leaks nothing about where they differ.
+ *
+ * Parameters:
+ *	a		The first buffer.
+ *	a_len	The length of the first buffer.
+ *	b		The second buffer.
+ *	b_len	The length of the second buffer.
+ *
+ * Returns: Non-zero if the buffers are identical, zero otherwise.
+ */
+static int constant_time_equals(const void* a, UInt32 a_len, const void* b, UInt32 b_len) {
+	const unsigned char* x = a;
+	const unsigned char* y = b;
+	UInt32 diff = a_len ^ b_len;
+	UInt32 i;
+
+	for (i = 0; i < a_len; i++) {
+		diff |= x[i] ^ (i < b_len ? y[i] : 0);
+	}
+	return diff == 0;
+}
+
+/* Replace the contents of a keychain item if it currently holds the expected
+ * password. Takes ownership of both the item and the password data. Either
+ * password may be empty, in which case its str is NULL.
+ *
+ * Parameters:
+ *	env				The JNI environment.
+ *	item			The item found in the keychain.
+ *	password		The current password data for the item.
+ *	password_length	The length of the current password data.
+ *	expected		The password the caller expects the item to hold.
+ *	replacement		The new password.
+ *
+ * Returns: JNI_TRUE if the password was replaced, JNI_FALSE otherwise.
+ */
+static jboolean compare_and_set_item(JNIEnv* env, SecKeychainItemRef item, void* password, UInt32 password_length, const jstring_unpacked* expected, const jstring_unpacked* replacement) {
+	OSStatus status;
+	int matched;
+
+	matched = constant_time_equals(password, password_length, expected->str, expected->len);
+	bzero(password, password_length);
+	SecKeychainItemFreeContent(NULL, password);
+
+	if (matched) {
+		/* NULL data would mean "leave the password alone", not "empty". */
+		status = SecKeychainItemModifyContent(
+			item,
+			NULL,
+			replacement->len,
+			replacement->str != NULL ? replacement->str : ""
+		);
+		if (status != errSecSuccess) {
+			throw_osxkeychainexception(env, status);
+			matched = 0;
+		}
+	}
+	CFRelease(item);
+
+	return matched ? JNI_TRUE : JNI_FALSE;
+}
+
+/* Implementation of OSXKeychain._compareAndSetGenericPassword(). See the Java
+ * docs for explanations of the parameters.
+ */
+JNIEXPORT jboolean JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword(JNIEnv* env, jobject obj, jstring serviceName, jstring accountName, jstring expected, jstring replacement) {
+	OSStatus status;
+	jstring_unpacked service_name;
+	jstring_unpacked account_name;
+	jstring_unpacked expected_password;
+	jstring_unpacked replacement_password;
+	SecKeychainItemRef item;
+	void* password;
+	UInt32 password_length;
+	jboolean result = JNI_FALSE;
+	int missing_name;
+
+	/* Query the keychain. */
+	status = SecKeychainSetPreferenceDomain(kSecPreferencesDomainUser);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+		return JNI_FALSE;
+	}
+
+	if (expected == NULL || replacement == NULL) {
+		throw_exception(env, OSXKeychainException, "The expected and replacement passwords must not be null.");
+		return JNI_FALSE;
+	}
+
+	/* Unpack the params. Empty passwords are allowed and unpack to a NULL
+	 * str with a zero len.
+	 */
+	jstring_unpack(env, serviceName, &service_name);
+	jstring_unpack(env, accountName, &account_name);
+	jstring_unpack(env, expected, &expected_password);
+	jstring_unpack(env, replacement, &replacement_password);
+	missing_name = service_name.len == 0 || account_name.len == 0;
+	if (service_name.str == NULL ||
+		account_name.str == NULL ||
+		(expected_password.str == NULL && expected_password.len > 0) ||
+		(replacement_password.str == NULL && replacement_password.len > 0)) {
+		jstring_unpacked_free(env, serviceName, &service_name);
+		jstring_unpacked_free(env, accountName, &account_name);
+		jstring_unpacked_free(env, expected, &expected_password);
+		jstring_unpacked_free(env, replacement, &replacement_password);
+		if (missing_name) {
+			throw_exception(env, OSXKeychainException, "A service name and an account name are required.");
+		}
+		return JNI_FALSE;
+	}
+
+	status = SecKeychainFindGenericPassword(
+		NULL,
+		service_name.len,
+		service_name.str,
+		account_name.len,
+		account_name.str,
+		&password_length,
+		&password,
+		&item
+	);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+	}
+	else {
+		result = compare_and_set_item(env, item, password, password_length, &expected_password, &replacement_password);
+	}
+
+	/* Clean up. */
+	jstring_unpacked_free(env, serviceName, &service_name);
+	jstring_unpacked_free(env, accountName, &account_name);
+	jstring_unpacked_free(env, expected, &expected_password);
+	jstring_unpacked_free(env, replacement, &replacement_password);
+
+	return result;
+}
+
+/* Implementation of OSXKeychain._compareAndSetInternetPassword(). See the
+ * Java docs for explanations of the parameters. The security domain and path
+ * are optional.
+ */
+JNIEXPORT jboolean JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetInternetPassword(JNIEnv* env, jobject obj, jstring serverName, jstring securityDomain, jstring accountName, jstring path, jint port, jstring expected, jstring replacement) {
+	OSStatus status;
+	jstring_unpacked server_name;
+	jstring_unpacked security_domain;
+	jstring_unpacked account_name;
+	jstring_unpacked server_path;
+	jstring_unpacked expected_password;
+	jstring_unpacked replacement_password;
+	SecKeychainItemRef item;
+	void* password;
+	UInt32 password_length;
+	jboolean result = JNI_FALSE;
+	int missing_name;
+
+	/* Query the keychain. */
+	status = SecKeychainSetPreferenceDomain(kSecPreferencesDomainUser);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+		return JNI_FALSE;
+	}
+
+	if (expected == NULL || replacement == NULL) {
+		throw_exception(env, OSXKeychainException, "The expected and replacement passwords must not be null.");
+		return JNI_FALSE;
+	}
+
+	/* Unpack the params. Empty passwords are allowed and unpack to a NULL
+	 * str with a zero len.
+	 */
+	jstring_unpack(env, serverName, &server_name);
+	jstring_unpack(env, securityDomain, &security_domain);
+	jstring_unpack(env, accountName, &account_name);
+	jstring_unpack(env, path, &server_path);
+	jstring_unpack(env, expected, &expected_password);
+	jstring_unpack(env, replacement, &replacement_password);
+	missing_name = server_name.len == 0 || account_name.len == 0;
+	if (server_name.str == NULL ||
+		account_name.str == NULL ||
+		(security_domain.str == NULL && security_domain.len > 0) ||
+		(server_path.str == NULL && server_path.len > 0) ||
+		(expected_password.str == NULL && expected_password.len > 0) ||
+		(replacement_password.str == NULL && replacement_password.len > 0)) {
+		jstring_unpacked_free(env, serverName, &server_name);
+		jstring_unpacked_free(env, securityDomain, &security_domain);
+		jstring_unpacked_free(env, accountName, &account_name);
+		jstring_unpacked_free(env, path, &server_path);
+		jstring_unpacked_free(env, expected, &expected_password);
+		jstring_unpacked_free(env, replacement, &replacement_password);
+		if (missing_name) {
+			throw_exception(env, OSXKeychainException, "A server name and an account name are required.");
+		}
+		return JNI_FALSE;
+	}
+
+	status = SecKeychainFindInternetPassword(
+		NULL,
+		server_name.len,
+		server_name.str,
+		security_domain.len,
+		security_domain.str,
+		account_name.len,
+		account_name.str,
+		server_path.len,
+		server_path.str,
+		port,
+		kSecProtocolTypeAny,
+		kSecAuthenticationTypeAny,
+		&password_length,
+		&password,
+		&item
+	);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+	}
+	else {
+		result = compare_and_set_item(env, item, password, password_length, &expected_password, &replacement_password);
+	}
+
+	/* Clean up. */
+	jstring_unpacked_free(env, serverName, &server_name);
+	jstring_unpacked_free(env, securityDomain, &security_domain);
+	jstring_unpacked_free(env, accountName, &account_name);
+	jstring_unpacked_free(env, path, &server_path);
+	jstring_unpacked_free(env, expected, &expected_password);
+	jstring_unpacked_free(env, replacement, &replacement_password);
+
+	return result;
+}
+
+/* A password being read into Java a piece at a time. The data is the buffer
+ * returned by the keychain so it is never copied on the native side.
+ */
+typedef struct {
+	void* data;
+	UInt32 length;
+	UInt32 position;
+} secret_reader;
+
+/* A password being written from Java a piece at a time. The data is
+ * collected here until the writer is committed to the keychain.
+ */
+typedef struct {
+	char* data;
+	UInt32 length;
+	UInt32 capacity;
+} secret_writer;
+
+/* The number of bytes of secret currently held in secret_reader and
+ * secret_writer buffers, and the most held at once since the peak was last
+ * reset. These let the benchmark see the native memory used by streams.
+ */
+static volatile int64_t secret_bytes = 0;
+static volatile int64_t secret_bytes_peak = 0;
+
+/* Record a change in the number of bytes held by secret readers and writers.
+ *
+ * Parameters:
+ *	delta	The number of bytes allocated, or negative for bytes freed.
+ */
+static void secret_bytes_add(int64_t delta) {
+	int64_t now = OSAtomicAdd64Barrier(delta, &secret_bytes);
+	int64_t peak;
+
+	do {
+		peak = secret_bytes_peak;
+		if (now <= peak) {
+			return;
+		}
+	} while (!OSAtomicCompareAndSwap64Barrier(peak, now, &secret_bytes_peak));
+}
+
+/* Implementation of OSXKeychain._secretBytesPeak(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT jlong JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1secretBytesPeak(JNIEnv* env, jclass cls, jboolean reset) {
+	int64_t peak = secret_bytes_peak;
+
+	if (reset) {
+		secret_bytes_peak = secret_bytes;
+	}
+	return (jlong)peak;
+}
+
+/* Implementation of OSXKeychain._openSecretReader(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT jlong JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1openSecretReader(JNIEnv* env, jobject obj, jstring serviceName, jstring accountName) {
+	OSStatus status;
+	jstring_unpacked service_name;
+	jstring_unpacked account_name;
+	secret_reader* reader = NULL;
+	void* password;
+	UInt32 password_length;
+
+	/* Query the keychain. */
+	status = SecKeychainSetPreferenceDomain(kSecPreferencesDomainUser);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+		return 0;
+	}
+
+	/* Unpack the params. */
+	jstring_unpack(env, serviceName, &service_name);
+	jstring_unpack(env, accountName, &account_name);
+	if (service_name.str == NULL ||
+		account_name.str == NULL) {
+		if (service_name.len == 0 || account_name.len == 0) {
+			throw_exception(env, OSXKeychainException, "A service name and an account name are required.");
+		}
+		jstring_unpacked_free(env, serviceName, &service_name);
+		jstring_unpacked_free(env, accountName, &account_name);
+		return 0;
+	}
+
+	status = SecKeychainFindGenericPassword(
+		NULL,
+		service_name.len,
+		service_name.str,
+		account_name.len,
+		account_name.str,
+		&password_length,
+		&password,
+		NULL
+	);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+	}
+	else {
+		reader = malloc(sizeof(secret_reader));
+		if (reader == NULL) {
+			bzero(password, password_length);
+			SecKeychainItemFreeContent(NULL, password);
+			throw_exception(env, OSXKeychainException, "Failed to allocate a secret reader.");
+		}
+		else {
+			reader->data = password;
+			reader->length = password_length;
+			reader->position = 0;
+			secret_bytes_add(password_length);
+		}
+	}
+
+	/* Clean up. */
+	jstring_unpacked_free(env, serviceName, &service_name);
+	jstring_unpacked_free(env, accountName, &account_name);
+
+	return (jlong)(intptr_t)reader;
+}
+
+/* Implementation of OSXKeychain._readSecret(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT jint JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1readSecret(JNIEnv* env, jobject obj, jlong handle, jbyteArray buffer, jint offset, jint length) {
+	secret_reader* reader = (secret_reader*)(intptr_t)handle;
+	UInt32 remaining = reader->length - reader->position;
+
+	if (remaining == 0) {
+		return -1;
+	}
+	if (length < 0) {
+		return 0;
+	}
+	if ((UInt32)length > remaining) {
+		length = (jint)remaining;
+	}
+	(*env)->SetByteArrayRegion(env, buffer, offset, length, (jbyte*)reader->data + reader->position);
+	reader->position += length;
+
+	return length;
+}
+
+/* Implementation of OSXKeychain._closeSecretReader(). */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1closeSecretReader(JNIEnv* env, jobject obj, jlong handle) {
+	secret_reader* reader = (secret_reader*)(intptr_t)handle;
+
+	bzero(reader->data, reader->length);
+	SecKeychainItemFreeContent(NULL, reader->data);
+	secret_bytes_add(-(int64_t)reader->length);
+	free(reader);
+}
+
+/* Implementation of OSXKeychain._openSecretWriter(). */
+JNIEXPORT jlong JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1openSecretWriter(JNIEnv* env, jobject obj) {
+	secret_writer* writer = calloc(1, sizeof(secret_writer));
+
+	if (writer == NULL) {
+		throw_exception(env, OSXKeychainException, "Failed to allocate a secret writer.");
+	}
+	return (jlong)(intptr_t)writer;
+}
+
+/* Implementation of OSXKeychain._writeSecret(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1writeSecret(JNIEnv* env, jobject obj, jlong handle, jbyteArray buffer, jint offset, jint length) {
+	secret_writer* writer = (secret_writer*)(intptr_t)handle;
+	UInt32 capacity;
+	char* data;
+
+	if (length <= 0) {
+		return;
+	}
+	if ((UInt32)length > UINT32_MAX - writer->length) {
+		throw_exception(env, OSXKeychainException, "The secret is too large for the keychain.");
+		return;
+	}
+
+	/* Grow the buffer. This doesn't use realloc so that the old buffer can
+	 * be wiped before it's freed.
+	 */
+	if (writer->length + length > writer->capacity) {
+		capacity = writer->capacity < 4096 ? 4096 : writer->capacity;
+		while (capacity < writer->length + length) {
+			capacity = capacity > UINT32_MAX / 2 ? UINT32_MAX : capacity * 2;
+		}
+		data = malloc(capacity);
+		if (data == NULL) {
+			throw_exception(env, OSXKeychainException, "Failed to grow the secret writer.");
+			return;
+		}
+		secret_bytes_add(capacity);
+		if (writer->data != NULL) {
+			memcpy(data, writer->data, writer->length);
+			bzero(writer->data, writer->length);
+			free(writer->data);
+			secret_bytes_add(-(int64_t)writer->capacity);
+		}
+		writer->data = data;
+		writer->capacity = capacity;
+	}
+
+	(*env)->GetByteArrayRegion(env, buffer, offset, length, (jbyte*)writer->data + writer->length);
+	writer->length += length;
+}
+
+/* Implementation of OSXKeychain._commitSecretWriter(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1commitSecretWriter(JNIEnv* env, jobject obj, jlong handle, jstring serviceName, jstring accountName) {
+	secret_writer* writer = (secret_writer*)(intptr_t)handle;
+	OSStatus status;
+	jstring_unpacked service_name;
+	jstring_unpacked account_name;
+	SecKeychainItemRef existingItem;
+
+	/* Query the keychain. */
+	status = SecKeychainSetPreferenceDomain(kSecPreferencesDomainUser);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+		return;
+	}
+
+	/* Unpack the params. */
+	jstring_unpack(env, serviceName, &service_name);
+	jstring_unpack(env, accountName, &account_name);
+	if (service_name.str == NULL ||
+		account_name.str == NULL) {
+		if (service_name.len == 0 || account_name.len == 0) {
+			throw_exception(env, OSXKeychainException, "A service name and an account name are required.");
+		}
+		jstring_unpacked_free(env, serviceName, &service_name);
+		jstring_unpacked_free(env, accountName, &account_name);
+		return;
+	}
+
+	/* Replace the password if it exists, otherwise add it. */
+	status = SecKeychainFindGenericPassword(
+		NULL,
+		service_name.len,
+		service_name.str,
+		account_name.len,
+		account_name.str,
+		NULL,
+		NULL,
+		&existingItem
+	);
+	if (status == errSecSuccess) {
+		status = SecKeychainItemModifyContent(
+			existingItem,
+			NULL,
+			writer->length,
+			writer->data
+		);
+		CFRelease(existingItem);
+	}
+	else if (status == errSecItemNotFound) {
+		status = SecKeychainAddGenericPassword(
+			NULL,
+			service_name.len,
+			service_name.str,
+			account_name.len,
+			account_name.str,
+			writer->length,
+			writer->data,
+			NULL
+		);
+	}
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+	}
+
+	/* Clean up. */
+	jstring_unpacked_free(env, serviceName, &service_name);
+	jstring_unpacked_free(env, accountName, &account_name);
+}
+
+/* Implementation of OSXKeychain._freeSecretWriter(). */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1freeSecretWriter(JNIEnv* env, jobject obj, jlong handle) {
+	secret_writer* writer = (secret_writer*)(intptr_t)handle;
+
+	if (writer->data != NULL) {
+		bzero(writer->data, writer->length);
+		free(writer->data);
+		secret_bytes_add(-(int64_t)writer->capacity);
+	}
+	free(writer);
+}
+
+/* Convert a keychain date attribute (e.g. "20110603223003Z") to milliseconds
+ * since the epoch.
+ *
+ * Parameters:
+ *	data	The attribute data.
+ *	len		The length of the attribute data.
+ *
+ * Returns: The time in milliseconds, or 0 if the date could not be parsed.
+ */
+static jlong keychain_date_to_millis(const void* data, UInt32 len) {
+	char buffer[15];
+	struct tm tm;
+
+	if (data == NULL || len < 14) {
+		return 0;
+	}
+	memcpy(buffer, data, 14);
+	buffer[14] = 0;
+
+	bzero(&tm, sizeof(tm));
+	if (sscanf(buffer, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+		return 0;
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	return (jlong)timegm(&tm) * 1000;
+}
+
+/* Read a 32 bit integer keychain attribute.
+ *
+ * Parameters:
+ *	attr	The attribute.
+ *
+ * Returns: The value, or 0 if the attribute is missing.
+ */
+static jint keychain_attribute_int(const SecKeychainAttribute* attr) {
+	UInt32 value;
+
+	if (attr->data == NULL || attr->length != sizeof(UInt32)) {
+		return 0;
+	}
+	memcpy(&value, attr->data, sizeof(UInt32));
+	return (jint)value;
+}
+
+/* Make a jstring from a keychain attribute.
+ *
+ * Parameters:
+ *	env		The JNI environment.
+ *	attr	The attribute.
+ *
+ * Returns: The jstring, or NULL if the attribute is empty.
+ */
+static jstring keychain_attribute_jstring(JNIEnv* env, const SecKeychainAttribute* attr) {
+	char* str = copy_attribute_string(attr->data, attr->length);
+	jstring result = NULL;
+
+	if (str != NULL) {
+		result = (*env)->NewStringUTF(env, str);
+		free(str);
+	}
+	return result;
+}
+
+/* The attributes read for the metadata index. The first MD_GENERIC_COUNT are
+ * the ones which generic passwords have.
+ */
+#define MD_NAME		0
+#define MD_ACCOUNT	1
+#define MD_MODIFIED	2
+#define MD_PATH		3
+#define MD_PORT		4
+#define MD_PROTOCOL	5
+#define MD_GENERIC_COUNT	3
+#define MD_INTERNET_COUNT	6
+
+/* Add the metadata of every item of one class to a java.util.List, reading
+ * only attributes so that no secret is decrypted.
+ *
+ * Parameters:
+ *	env			The JNI environment.
+ *	items		The List to add OSXKeychainItemMetadata objects to.
+ *	add			The method ID of List.add.
+ *	cls			The OSXKeychainItemMetadata class.
+ *	constructor	The method ID of the OSXKeychainItemMetadata constructor.
+ *	item_class	kSecGenericPasswordItemClass or kSecInternetPasswordItemClass.
+ *
+ * Returns: errSecSuccess or the status of the failed keychain call. If a Java
+ *			exception has been thrown this returns errSecSuccess and the
+ *			caller must check for it.
+ */
+static OSStatus list_item_metadata(JNIEnv* env, jobject items, jmethodID add, jclass cls, jmethodID constructor, SecItemClass item_class) {
+	OSStatus status;
+	SecKeychainSearchRef search;
+	SecKeychainItemRef item;
+	SecKeychainAttribute attrs[MD_INTERNET_COUNT];
+	SecKeychainAttributeList attr_list;
+	jboolean internet = item_class == kSecInternetPasswordItemClass;
+	jstring name;
+	jstring account;
+	jstring path;
+	jobject metadata;
+	int i;
+
+	status = SecKeychainSearchCreateFromAttributes(NULL, item_class, NULL, &search);
+	if (status != errSecSuccess) {
+		return status;
+	}
+
+	while ((status = SecKeychainSearchCopyNext(search, &item)) == errSecSuccess) {
+		attrs[MD_NAME].tag = internet ? kSecServerItemAttr : kSecServiceItemAttr;
+		attrs[MD_ACCOUNT].tag = kSecAccountItemAttr;
+		attrs[MD_MODIFIED].tag = kSecModDateItemAttr;
+		attrs[MD_PATH].tag = kSecPathItemAttr;
+		attrs[MD_PORT].tag = kSecPortItemAttr;
+		attrs[MD_PROTOCOL].tag = kSecProtocolItemAttr;
+		for (i = 0; i < MD_INTERNET_COUNT; i++) {
+			attrs[i].length = 0;
+			attrs[i].data = NULL;
+		}
+		attr_list.count = internet ? MD_INTERNET_COUNT : MD_GENERIC_COUNT;
+		attr_list.attr = attrs;
+
+		status = SecKeychainItemCopyContent(item, NULL, &attr_list, NULL, NULL);
+		CFRelease(item);
+		if (status != errSecSuccess) {
+			/* Skip items we can't read rather than failing the whole walk. */
+			continue;
+		}
+
+		name = keychain_attribute_jstring(env, &attrs[MD_NAME]);
+		account = keychain_attribute_jstring(env, &attrs[MD_ACCOUNT]);
+		path = keychain_attribute_jstring(env, &attrs[MD_PATH]);
+		metadata = (*env)->NewObject(
+			env,
+			cls,
+			constructor,
+			internet,
+			name,
+			account,
+			path,
+			keychain_attribute_int(&attrs[MD_PORT]),
+			keychain_attribute_int(&attrs[MD_PROTOCOL]),
+			keychain_date_to_millis(attrs[MD_MODIFIED].data, attrs[MD_MODIFIED].length)
+		);
+		SecKeychainItemFreeContent(&attr_list, NULL);
+		if (metadata != NULL) {
+			(*env)->CallBooleanMethod(env, items, add, metadata);
+		}
+
+		/* Keychains can be big, don't run out of local refs. */
+		(*env)->DeleteLocalRef(env, name);
+		(*env)->DeleteLocalRef(env, account);
+		(*env)->DeleteLocalRef(env, path);
+		(*env)->DeleteLocalRef(env, metadata);
+		if ((*env)->ExceptionCheck(env)) {
+			break;
+		}
+	}
+	CFRelease(search);
+
+	return status == errSecItemNotFound ? errSecSuccess : status;
+}
+
+/* Implementation of OSXKeychain._listItemMetadata(). See the Java docs for
+ * explanations of the parameters.
+ */
+JNIEXPORT void JNICALL Java_com_mcdermottroe_apple_OSXKeychain__1listItemMetadata(JNIEnv* env, jobject obj, jobject items) {
+	OSStatus status;
+	jclass list_cls;
+	jclass cls;
+	jmethodID add;
+	jmethodID constructor;
+
+	/* Query the keychain. */
+	status = SecKeychainSetPreferenceDomain(kSecPreferencesDomainUser);
+	if (status != errSecSuccess) {
+		throw_osxkeychainexception(env, status);
+		return;
+	}
+
+	list_cls = (*env)->GetObjectClass(env, items);
+	add = (*env)->GetMethodID(env, list_cls, "add", "(Ljava/lang/Object;)Z");
+	(*env)->DeleteLocalRef(env, list_cls);
+	if (add == NULL) {
+		return;
+	}
+	cls = (*env)->FindClass(env, OSXKeychainItemMetadata);
+	if (cls == NULL) {
+		return;
+	}
+	constructor = (*env)->GetMethodID(env, cls, "<init>", OSXKeychainItemMetadataConstructor);
+	if (constructor == NULL) {
+		(*env)->DeleteLocalRef(env, cls);
+		return;
+	}
+
+	status = list_item_metadata(env, items, add, cls, constructor, kSecGenericPasswordItemClass);
+	if (status == errSecSuccess && !(*env)->ExceptionCheck(env)) {
+		status = list_item_metadata(env, items, add, cls, constructor, kSecInternetPasswordItemClass);
+	}
+	if (status != errSecSuccess && !(*env)->ExceptionCheck(env)) {
+		throw_osxkeychainexception(env, status);
+	}
+
+	(*env)->DeleteLocalRef(env, cls);
+}
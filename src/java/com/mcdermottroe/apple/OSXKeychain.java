@@ -32,8 +32,23 @@ import java.io.IOException;
 import java.io.InputStream;
 import java.io.OutputStream;
 import java.net.URL;
+import java.util.ArrayList;
 import java.util.HashMap;
+import java.util.List;
 import java.util.Map;
+import java.util.concurrent.Callable;
+import java.util.concurrent.CopyOnWriteArrayList;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.Future;
+import java.util.concurrent.RejectedExecutionException;
+import java.util.concurrent.SynchronousQueue;
+import java.util.concurrent.ThreadFactory;
+import java.util.concurrent.ThreadPoolExecutor;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.TimeoutException;
+import java.util.concurrent.atomic.AtomicLong;
+
+import com.mcdermottroe.apple.OSXKeychainAdmissionControl.Kind;
 
 /** An interface to the OS X Keychain. The names of functions and parameters
  *	will mostly match the functions listed in the <a href="http://developer.apple.com/library/mac/#documentation/Security/Reference/keychainservices/Reference/reference.html">Keychain Services Reference</a>.
@@ -46,8 +61,73 @@ public class OSXKeychain {
 	 */
 	private static OSXKeychain instance;
 
+	/** How long, in milliseconds, the event dispatcher blocks in native code
+	 *	waiting for an event before going around its loop again.
+	 */
+	private static final long EVENT_WAIT_MILLIS = 1000;
+
+	/** The most calls with a timeout which may be running at once, including
+	 *	ones which have timed out but are still stuck in the keychain. Calls
+	 *	beyond this are rejected immediately rather than queued, because a
+	 *	queued call would spend its deadline waiting behind calls which are
+	 *	already stuck.
+	 */
+	private static final int MAX_DEADLINE_WORKERS = 32;
+
+	/** The threads which run calls made with a timeout, so that the calling
+	 *	thread can give up on them.
+	 */
+	private final ThreadPoolExecutor deadlineWorkers = new ThreadPoolExecutor(
+		0,
+		MAX_DEADLINE_WORKERS,
+		60,
+		TimeUnit.SECONDS,
+		new SynchronousQueue<Runnable>(),
+		new ThreadFactory() {
+			public Thread newThread(Runnable r) {
+				Thread t = new Thread(r, "OSXKeychain deadline worker");
+				t.setDaemon(true);
+				return t;
+			}
+		}
+	);
+
+	/** The keychain calls behind the add and find methods and the source of
+	 *	keychain events, which tests can replace with {@link
+	 *	#withBackend(Backend)}.
+	 */
+	private Backend backend = new NativeBackend();
+
+	/** The number of calls which have missed their deadline. */
+	private final AtomicLong timeouts = new AtomicLong();
+
+	/** The limits on calls into the keychain, or null for no limits. */
+	private volatile OSXKeychainAdmissionControl admissionControl;
+
+	/** The number of locks in {@link #compareAndSetLocks}. */
+	private static final int COMPARE_AND_SET_LOCKS = 64;
+
+	/** One of these is held for the duration of every compare-and-set so
+	 *	that two rotations in this JVM can't both succeed against the same
+	 *	password. The lock is chosen by the names which identify the item, so
+	 *	compare-and-set calls on unrelated items rarely wait for each other.
+	 */
+	private final Object[] compareAndSetLocks = new Object[COMPARE_AND_SET_LOCKS];
+
+	/** The listeners to notify of changes to the keychain. */
+	private final List<OSXKeychainListener> listeners = new CopyOnWriteArrayList<OSXKeychainListener>();
+
+	/** The thread which delivers keychain events to {@link #listeners}.
+	 *	Started by the first call to {@link
+	 *	#addKeychainListener(OSXKeychainListener)}.
+	 */
+	private Thread eventDispatcher;
+
 	/** Prevent this class from being instantiated directly. */
 	private OSXKeychain() {
+		for (int i = 0; i < compareAndSetLocks.length; i++) {
+			compareAndSetLocks[i] = new Object();
+		}
 	}
 
 	/** Get an instance of the keychain.
@@ -70,6 +150,40 @@ public class OSXKeychain {
 		return instance;
 	}
 
+	/** Create a keychain which uses a backend other than the native one,
+	 *	without loading the native library. Only tests should call this, to
+	 *	simulate the keychain on machines which don't have one.
+	 *
+	 *	@param	backend	The backend to use.
+	 *	@return			A new keychain, separate from {@link #getInstance()}.
+	 */
+	static OSXKeychain withBackend(Backend backend) {
+		OSXKeychain keychain = new OSXKeychain();
+		keychain.backend = backend;
+		return keychain;
+	}
+
+	/** Limit the rate and concurrency of calls into the keychain. Calls made
+	 *	while the limits are saturated wait up to the configured maximum and
+	 *	then fail with an {@link OSXKeychainRejectedException}.
+	 *
+	 *	@param	admissionControl	The limits to apply, or null to remove any
+	 *								limits.
+	 */
+	public void setAdmissionControl(OSXKeychainAdmissionControl admissionControl) {
+		this.admissionControl = admissionControl;
+	}
+
+	/** Get the limits on calls into the keychain.
+	 *
+	 *	@return	The limits set by {@link
+	 *			#setAdmissionControl(OSXKeychainAdmissionControl)}, or null if
+	 *			there are none.
+	 */
+	public OSXKeychainAdmissionControl getAdmissionControl() {
+		return admissionControl;
+	}
+
 	/** Add a non-internet password to the keychain.
 	 *
 	 *	@param	serviceName				The name of the service the password is
@@ -83,7 +197,12 @@ public class OSXKeychain {
 	public void addGenericPassword(String serviceName, String accountName, String password)
 	throws OSXKeychainException
 	{
-		_addGenericPassword(serviceName, accountName, password);
+		OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+		try {
+			backend.addGenericPassword(serviceName, accountName, password);
+		} finally {
+			leave(admission, Kind.WRITE);
+		}
 	}
 
 	/** Update an existing non-internet password to the keychain.
@@ -99,7 +218,12 @@ public class OSXKeychain {
 	public void modifyGenericPassword(String serviceName, String accountName, String password)
 	throws OSXKeychainException
 	{
-		_modifyGenericPassword(serviceName, accountName, password);
+		OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+		try {
+			_modifyGenericPassword(serviceName, accountName, password);
+		} finally {
+			leave(admission, Kind.WRITE);
+		}
 	}
 
 	/** Add an internet password to the keychain.
@@ -164,7 +288,12 @@ public class OSXKeychain {
 	public void addInternetPassword(String serverName, String securityDomain, String accountName, String path, int port, OSXKeychainProtocolType protocol, OSXKeychainAuthenticationType authenticationType, String password)
 	throws OSXKeychainException
 	{
-		_addInternetPassword(serverName, securityDomain, accountName, path, port, protocol.getValue(), authenticationType.getValue(), password);
+		OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+		try {
+			backend.addInternetPassword(serverName, securityDomain, accountName, path, port, protocol.getValue(), authenticationType.getValue(), password);
+		} finally {
+			leave(admission, Kind.WRITE);
+		}
 	}
 
 	/** Find a password in the keychain which is not an Internet Password.
@@ -181,7 +310,12 @@ public class OSXKeychain {
 	public String findGenericPassword(String serviceName, String accountName)
 	throws OSXKeychainException
 	{
-		return _findGenericPassword(serviceName, accountName);
+		OSXKeychainAdmissionControl admission = admit(Kind.READ);
+		try {
+			return backend.findGenericPassword(serviceName, accountName);
+		} finally {
+			leave(admission, Kind.READ);
+		}
 	}
 
 	/** Find an Internet Password in the keychain. This is a convenience method
@@ -224,7 +358,7 @@ public class OSXKeychain {
 	public String findInternetPassword(String serverName, String accountName, String path)
 	throws OSXKeychainException
 	{
-		return _findInternetPassword(serverName, null, accountName, path, 0);
+		return findInternetPassword(serverName, null, accountName, path, 0);
 	}
 
 	/** Find an Internet Password in the keychain.
@@ -249,7 +383,12 @@ public class OSXKeychain {
 	public String findInternetPassword(String serverName, String securityDomain, String accountName, String path, int port)
 	throws OSXKeychainException
 	{
-		return _findInternetPassword(serverName, securityDomain, accountName, path, port);
+		OSXKeychainAdmissionControl admission = admit(Kind.READ);
+		try {
+			return backend.findInternetPassword(serverName, securityDomain, accountName, path, port);
+		} finally {
+			leave(admission, Kind.READ);
+		}
 	}
 
 	/** Delete a generic password from the keychain.
@@ -264,7 +403,567 @@ public class OSXKeychain {
 	public void deleteGenericPassword(String serviceName, String accountName)
 	throws OSXKeychainException
 	{
-		_deleteGenericPassword(serviceName, accountName);
+		OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+		try {
+			_deleteGenericPassword(serviceName, accountName);
+		} finally {
+			leave(admission, Kind.WRITE);
+		}
+	}
+
+	/** Add a non-internet password to the keychain, giving up if it takes
+	 *	too long. See {@link #findGenericPassword(String, String, long,
+	 *	TimeUnit)} for what happens when the timeout expires; in particular
+	 *	the password may still be added after this has thrown.
+	 *
+	 *	@param	serviceName				The name of the service the password is
+	 *									for.
+	 *	@param	accountName				The account name/username for the
+	 *									service.
+	 *	@param	password				The password for the service.
+	 *	@param	timeout					The longest to wait for the keychain.
+	 *	@param	unit					The unit of timeout.
+	 *	@throws	OSXKeychainTimeoutException	If the keychain did not respond
+	 *									in time.
+	 *	@throws	OSXKeychainRejectedException	If the maximum number of
+	 *									calls with a timeout are already
+	 *									running, including stuck ones. Calls
+	 *									are never queued.
+	 *	@throws OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	public void addGenericPassword(final String serviceName, final String accountName, final String password, long timeout, TimeUnit unit)
+	throws OSXKeychainException
+	{
+		callWithDeadline(
+			new Callable<Void>() {
+				public Void call()
+				throws OSXKeychainException
+				{
+					addGenericPassword(serviceName, accountName, password);
+					return null;
+				}
+			},
+			timeout,
+			unit
+		);
+	}
+
+	/** Add an internet password to the keychain, giving up if it takes too
+	 *	long. See {@link #findGenericPassword(String, String, long, TimeUnit)}
+	 *	for what happens when the timeout expires; in particular the password
+	 *	may still be added after this has thrown.
+	 *
+	 *	@param	serverName				The name of the server which the
+	 *									password is for.
+	 *	@param	securityDomain			The security domain which some
+	 *									protocols need.
+	 *	@param	accountName				The account name/username for the
+	 *									password.
+	 *	@param	path					The path on the server for which the
+	 *									credentials should be used.
+	 *	@param	port					Only return the password if connecting
+	 *									to this port.
+	 *	@param	protocol				Only return the password for this
+	 *									protocol.
+	 *	@param	authenticationType		The type of authentication the password
+	 *									is for.
+	 *	@param	password				The password to add.
+	 *	@param	timeout					The longest to wait for the keychain.
+	 *	@param	unit					The unit of timeout.
+	 *	@throws	OSXKeychainTimeoutException	If the keychain did not respond
+	 *									in time.
+	 *	@throws	OSXKeychainRejectedException	If the maximum number of
+	 *									calls with a timeout are already
+	 *									running, including stuck ones. Calls
+	 *									are never queued.
+	 *	@throws OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	public void addInternetPassword(final String serverName, final String securityDomain, final String accountName, final String path, final int port, final OSXKeychainProtocolType protocol, final OSXKeychainAuthenticationType authenticationType, final String password, long timeout, TimeUnit unit)
+	throws OSXKeychainException
+	{
+		callWithDeadline(
+			new Callable<Void>() {
+				public Void call()
+				throws OSXKeychainException
+				{
+					addInternetPassword(serverName, securityDomain, accountName, path, port, protocol, authenticationType, password);
+					return null;
+				}
+			},
+			timeout,
+			unit
+		);
+	}
+
+	/** Find a generic password, giving up if the keychain takes too long to
+	 *	answer. The keychain can't be interrupted, so the call runs on a
+	 *	worker thread and carries on after the timeout; its result is
+	 *	available from {@link OSXKeychainTimeoutException#getLateResult()}
+	 *	and is otherwise simply discarded.
+	 *
+	 *	@param	serviceName				The name of the service the password is
+	 *									for.
+	 *	@param	accountName				The account name/username for the
+	 *									service.
+	 *	@param	timeout					The longest to wait for the keychain.
+	 *	@param	unit					The unit of timeout.
+	 *	@return							The password which matches the details
+	 *									supplied.
+	 *	@throws	OSXKeychainTimeoutException	If the keychain did not respond
+	 *									in time.
+	 *	@throws	OSXKeychainRejectedException	If the maximum number of
+	 *									calls with a timeout are already
+	 *									running, including stuck ones. Calls
+	 *									are never queued.
+	 *	@throws	OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	public String findGenericPassword(final String serviceName, final String accountName, long timeout, TimeUnit unit)
+	throws OSXKeychainException
+	{
+		return callWithDeadline(
+			new Callable<String>() {
+				public String call()
+				throws OSXKeychainException
+				{
+					return findGenericPassword(serviceName, accountName);
+				}
+			},
+			timeout,
+			unit
+		);
+	}
+
+	/** Find an internet password, giving up if the keychain takes too long to
+	 *	answer. See {@link #findGenericPassword(String, String, long,
+	 *	TimeUnit)} for what happens when the timeout expires.
+	 *
+	 *	@param	serverName				The name of the server. e.g.
+	 *									"github.com".
+	 *	@param	securityDomain			The security domain which is needed for
+	 *									some protocols. Pass null if not
+	 *									needed.
+	 *	@param	accountName				The account name/username. e.g.
+	 *									"conormcd".
+	 *	@param	path					The path to the password protected
+	 *									resource on the server. e.g. "/login".
+	 *	@param	port					The port to connect to. Pass 0 if you
+	 *									want the first result for any entry
+	 *									matching the rest of the criteria.
+	 *	@param	timeout					The longest to wait for the keychain.
+	 *	@param	unit					The unit of timeout.
+	 *	@return							The first password which matches the
+	 *									details supplied.
+	 *	@throws	OSXKeychainTimeoutException	If the keychain did not respond
+	 *									in time.
+	 *	@throws	OSXKeychainRejectedException	If the maximum number of
+	 *									calls with a timeout are already
+	 *									running, including stuck ones. Calls
+	 *									are never queued.
+	 *	@throws	OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	public String findInternetPassword(final String serverName, final String securityDomain, final String accountName, final String path, final int port, long timeout, TimeUnit unit)
+	throws OSXKeychainException
+	{
+		return callWithDeadline(
+			new Callable<String>() {
+				public String call()
+				throws OSXKeychainException
+				{
+					return findInternetPassword(serverName, securityDomain, accountName, path, port);
+				}
+			},
+			timeout,
+			unit
+		);
+	}
+
+	/** Get the number of calls made with a timeout which did not finish in
+	 *	time.
+	 *
+	 *	@return	The total number of timeouts.
+	 */
+	public long getTimeoutCount() {
+		return timeouts.get();
+	}
+
+	/** Replace a generic password only if it currently matches an expected
+	 *	value. The lookup, comparison and update happen in a single native
+	 *	call and the comparison takes the same time wherever the passwords
+	 *	differ. Compare-and-set calls in the same JVM on the same item are
+	 *	serialized so at most one of several concurrent rotations from the
+	 *	same expected value can succeed. Either password may be empty.
+	 *
+	 *	@param	serviceName				The name of the service the password is
+	 *									for.
+	 *	@param	accountName				The account name/username for the
+	 *									service.
+	 *	@param	expected				The password which must currently be in
+	 *									the keychain.
+	 *	@param	replacement				The new password.
+	 *	@return							True if the password matched and was
+	 *									replaced, false if it did not match.
+	 *	@throws	OSXKeychainException	If the password does not exist, a name
+	 *									or password is null, or an error
+	 *									occurs when communicating with the OS
+	 *									X keychain.
+	 */
+	public boolean compareAndSetGenericPassword(String serviceName, String accountName, String expected, String replacement)
+	throws OSXKeychainException
+	{
+		OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+		try {
+			synchronized (compareAndSetLock(serviceName, accountName)) {
+				return _compareAndSetGenericPassword(serviceName, accountName, expected, replacement);
+			}
+		} finally {
+			leave(admission, Kind.WRITE);
+		}
+	}
+
+	/** Replace an internet password only if it currently matches an expected
+	 *	value. See {@link #compareAndSetGenericPassword(String, String, String,
+	 *	String)} for the guarantees this makes.
+	 *
+	 *	@param	serverName				The name of the server. e.g.
+	 *									"github.com".
+	 *	@param	securityDomain			The security domain which is needed for
+	 *									some protocols. Pass null if not
+	 *									needed.
+	 *	@param	accountName				The account name/username. e.g.
+	 *									"conormcd".
+	 *	@param	path					The path to the password protected
+	 *									resource on the server. e.g. "/login".
+	 *	@param	port					The port to connect to. Pass 0 to match
+	 *									the first entry for any port.
+	 *	@param	expected				The password which must currently be in
+	 *									the keychain.
+	 *	@param	replacement				The new password.
+	 *	@return							True if the password matched and was
+	 *									replaced, false if it did not match.
+	 *	@throws	OSXKeychainException	If the password does not exist, a name
+	 *									or password is null, or an error
+	 *									occurs when communicating with the OS
+	 *									X keychain.
+	 */
+	public boolean compareAndSetInternetPassword(String serverName, String securityDomain, String accountName, String path, int port, String expected, String replacement)
+	throws OSXKeychainException
+	{
+		OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+		try {
+			synchronized (compareAndSetLock(serverName, accountName)) {
+				return _compareAndSetInternetPassword(serverName, securityDomain, accountName, path, port, expected, replacement);
+			}
+		} finally {
+			leave(admission, Kind.WRITE);
+		}
+	}
+
+	/** Choose the lock for a compare-and-set. Internet passwords are keyed
+	 *	on the server and account only, because a call with a null security
+	 *	domain, null path or port 0 may match the same item as a call which
+	 *	gives them.
+	 *
+	 *	@param	name	The service or server name.
+	 *	@param	account	The account name.
+	 *	@return			The lock to hold.
+	 */
+	private Object compareAndSetLock(String name, String account) {
+		int hash = 31 * (name == null ? 0 : name.hashCode()) + (account == null ? 0 : account.hashCode());
+		hash ^= hash >>> 16;
+		return compareAndSetLocks[(hash & 0x7fffffff) % compareAndSetLocks.length];
+	}
+
+	/** Read a generic password as a stream of bytes. This is intended for
+	 *	large secrets; the password is copied into the JVM a buffer at a time
+	 *	rather than being turned into a String, so the memory used on the Java
+	 *	side is bounded by the size of the buffers passed to read. The stream
+	 *	holds the keychain's copy of the password until it is closed.
+	 *
+	 *	@param	serviceName				The name of the service the password is
+	 *									for.
+	 *	@param	accountName				The account name/username for the
+	 *									service.
+	 *	@return							A stream of the bytes of the password.
+	 *	@throws	OSXKeychainException	If either name is null or empty, or an
+	 *									error occurs when communicating with
+	 *									the OS X keychain.
+	 */
+	public InputStream openGenericPasswordInputStream(String serviceName, String accountName)
+	throws OSXKeychainException
+	{
+		OSXKeychainAdmissionControl admission = admit(Kind.READ);
+		try {
+			return new SecretInputStream(_openSecretReader(serviceName, accountName));
+		} finally {
+			leave(admission, Kind.READ);
+		}
+	}
+
+	/** Write a generic password as a stream of bytes. This is the
+	 *	counterpart of {@link #openGenericPasswordInputStream(String, String)}.
+	 *	Nothing is written to the keychain until the stream is closed, at
+	 *	which point the password is modified if it exists and added if it
+	 *	does not.
+	 *
+	 *	@param	serviceName				The name of the service the password is
+	 *									for.
+	 *	@param	accountName				The account name/username for the
+	 *									service.
+	 *	@return							A stream to write the password to.
+	 *	@throws	OSXKeychainException	If the native buffer could not be
+	 *									allocated.
+	 */
+	public OutputStream openGenericPasswordOutputStream(String serviceName, String accountName)
+	throws OSXKeychainException
+	{
+		return new SecretOutputStream(_openSecretWriter(), serviceName, accountName);
+	}
+
+	/** Convert the service name and account name of a generic password into
+	 *	a form that can be used for repeated lookups without converting the
+	 *	strings each time. The returned key holds native memory, so {@link
+	 *	OSXKeychainPreparedKey#close()} it when it is no longer needed.
+	 *
+	 *	@param	serviceName				The name of the service the password is
+	 *									for.
+	 *	@param	accountName				The account name/username for the
+	 *									service.
+	 *	@return							A key to pass to {@link
+	 *									#findGenericPassword(OSXKeychainPreparedGenericKey)},
+	 *									{@link #modifyGenericPassword(OSXKeychainPreparedGenericKey,
+	 *									String)} or {@link
+	 *									#deleteGenericPassword(OSXKeychainPreparedGenericKey)}.
+	 *	@throws	OSXKeychainException	If either name is null or empty, or the
+	 *									key could not be allocated.
+	 */
+	public OSXKeychainPreparedGenericKey prepareGenericKey(String serviceName, String accountName)
+	throws OSXKeychainException
+	{
+		return new OSXKeychainPreparedGenericKey(_prepareGenericKey(serviceName, accountName));
+	}
+
+	/** Convert the identifying details of an internet password into a form
+	 *	that can be used for repeated lookups without converting the strings
+	 *	each time. The returned key holds native memory, so {@link
+	 *	OSXKeychainPreparedKey#close()} it when it is no longer needed. Every
+	 *	string must be non-empty, as the keychain treats an empty value as
+	 *	matching any item.
+	 *
+	 *	@param	serverName				The name of the server. e.g.
+	 *									"github.com".
+	 *	@param	securityDomain			The security domain of the password.
+	 *	@param	accountName				The account name/username. e.g.
+	 *									"conormcd".
+	 *	@param	path					The path to the password protected
+	 *									resource on the server. e.g. "/login".
+	 *	@param	port					The port to connect to. Pass 0 if you
+	 *									want the first result for any entry
+	 *									matching the rest of the criteria.
+	 *	@return							A key to pass to {@link
+	 *									#findInternetPassword(OSXKeychainPreparedInternetKey)}.
+	 *	@throws	OSXKeychainException	If any of the strings is null or empty,
+	 *									or the key could not be allocated.
+	 */
+	public OSXKeychainPreparedInternetKey prepareInternetKey(String serverName, String securityDomain, String accountName, String path, int port)
+	throws OSXKeychainException
+	{
+		return new OSXKeychainPreparedInternetKey(_prepareInternetKey(serverName, securityDomain, accountName, path, port));
+	}
+
+	/** Find a generic password using a prepared key.
+	 *
+	 *	@param	key						The key created by {@link
+	 *									#prepareGenericKey(String, String)}.
+	 *	@return							The password which matches the key.
+	 *	@throws	OSXKeychainException	If the key has been closed or an error
+	 *									occurs when communicating with the OS X
+	 *									keychain.
+	 */
+	public String findGenericPassword(OSXKeychainPreparedGenericKey key)
+	throws OSXKeychainException
+	{
+		long handle = key.acquire();
+		try {
+			OSXKeychainAdmissionControl admission = admit(Kind.READ);
+			try {
+				return _findGenericPasswordPrepared(handle);
+			} finally {
+				leave(admission, Kind.READ);
+			}
+		} finally {
+			key.release();
+		}
+	}
+
+	/** Update an existing generic password using a prepared key.
+	 *
+	 *	@param	key						The key created by {@link
+	 *									#prepareGenericKey(String, String)}.
+	 *	@param	password				The new password.
+	 *	@throws	OSXKeychainException	If the key has been closed or an error
+	 *									occurs when communicating with the OS X
+	 *									keychain.
+	 */
+	public void modifyGenericPassword(OSXKeychainPreparedGenericKey key, String password)
+	throws OSXKeychainException
+	{
+		long handle = key.acquire();
+		try {
+			OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+			try {
+				_modifyGenericPasswordPrepared(handle, password);
+			} finally {
+				leave(admission, Kind.WRITE);
+			}
+		} finally {
+			key.release();
+		}
+	}
+
+	/** Delete a generic password using a prepared key.
+	 *
+	 *	@param	key						The key created by {@link
+	 *									#prepareGenericKey(String, String)}.
+	 *	@throws	OSXKeychainException	If the key has been closed or an error
+	 *									occurs when communicating with the OS X
+	 *									keychain.
+	 */
+	public void deleteGenericPassword(OSXKeychainPreparedGenericKey key)
+	throws OSXKeychainException
+	{
+		long handle = key.acquire();
+		try {
+			OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+			try {
+				_deleteGenericPasswordPrepared(handle);
+			} finally {
+				leave(admission, Kind.WRITE);
+			}
+		} finally {
+			key.release();
+		}
+	}
+
+	/** Find an internet password using a prepared key.
+	 *
+	 *	@param	key						The key created by {@link
+	 *									#prepareInternetKey(String, String,
+	 *									String, String, int)}.
+	 *	@return							The first password which matches the
+	 *									key.
+	 *	@throws	OSXKeychainException	If the key has been closed or an error
+	 *									occurs when communicating with the OS X
+	 *									keychain.
+	 */
+	public String findInternetPassword(OSXKeychainPreparedInternetKey key)
+	throws OSXKeychainException
+	{
+		long handle = key.acquire();
+		try {
+			OSXKeychainAdmissionControl admission = admit(Kind.READ);
+			try {
+				return _findInternetPasswordPrepared(handle);
+			} finally {
+				leave(admission, Kind.READ);
+			}
+		} finally {
+			key.release();
+		}
+	}
+
+	/** Register a listener to be told about changes to items in the keychain,
+	 *	whether they're made by this JVM or by any other process. The first
+	 *	listener registers a callback with the keychain and starts a daemon
+	 *	thread to deliver the events. Anything thrown by a listener, including
+	 *	an Error, is passed to the uncaught exception handler for that thread,
+	 *	which can be set with {@link Thread#setDefaultUncaughtExceptionHandler},
+	 *	and delivery continues with the next listener. If the thread has died
+	 *	anyway, the next call to this starts a new one.
+	 *
+	 *	@param	listener				The listener to add.
+	 *	@throws	OSXKeychainException	If the keychain callback could not be
+	 *									registered.
+	 */
+	public synchronized void addKeychainListener(OSXKeychainListener listener)
+	throws OSXKeychainException
+	{
+		if (eventDispatcher == null || !eventDispatcher.isAlive()) {
+			backend.startKeychainEvents();
+			eventDispatcher = new Thread(
+				new Runnable() {
+					public void run() {
+						dispatchKeychainEvents();
+					}
+				},
+				"OSXKeychain event dispatcher"
+			);
+			eventDispatcher.setDaemon(true);
+			eventDispatcher.start();
+		}
+		listeners.add(listener);
+	}
+
+	/** Stop a listener from receiving keychain events.
+	 *
+	 *	@param	listener	The listener to remove.
+	 */
+	public void removeKeychainListener(OSXKeychainListener listener) {
+		listeners.remove(listener);
+	}
+
+	/** Open an index of the keychain which was written by {@link
+	 *	#refreshIndex(File)}. This doesn't touch the keychain or load the
+	 *	native library, so it can be used to list services and accounts
+	 *	cheaply, though the result is only as fresh as the last refresh.
+	 *
+	 *	@param	file					The index file.
+	 *	@return							The index.
+	 *	@throws	OSXKeychainException	If the file can't be read or is not a
+	 *									valid index.
+	 */
+	public static OSXKeychainIndex openIndex(File file)
+	throws OSXKeychainException
+	{
+		return OSXKeychainIndex.open(file);
+	}
+
+	/** Bring an index of the keychain up to date. The attributes of every
+	 *	generic and internet password are read, but none of the passwords,
+	 *	and the file is only rewritten if an item was added, removed or
+	 *	modified since the index was last written.
+	 *
+	 *	@param	file					The index file, which need not exist.
+	 *	@return							The up to date index.
+	 *	@throws	OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain or the file
+	 *									can't be written.
+	 */
+	public OSXKeychainIndex refreshIndex(File file)
+	throws OSXKeychainException
+	{
+		List<OSXKeychainItemMetadata> items = new ArrayList<OSXKeychainItemMetadata>();
+		OSXKeychainAdmissionControl admission = admit(Kind.READ);
+		try {
+			_listItemMetadata(items);
+		} finally {
+			leave(admission, Kind.READ);
+		}
+
+		if (file.exists()) {
+			try {
+				OSXKeychainIndex existing = OSXKeychainIndex.open(file);
+				if (existing.isCurrent(items)) {
+					return existing;
+				}
+			} catch (OSXKeychainException e) {
+				// Unreadable or corrupt, so replace it.
+			}
+		}
+		return OSXKeychainIndex.write(file, items);
 	}
 
 	/* ************************* */
@@ -376,6 +1075,264 @@ public class OSXKeychain {
 	private native void _deleteGenericPassword(String serviceName, String accountName)
 	throws OSXKeychainException;
 
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword
+	 *	for the implementation of this and use {@link
+	 *	#compareAndSetGenericPassword(String, String, String, String)} to call
+	 *	this.
+	 *
+	 *	@param	serviceName				The value which should be passed as the
+	 *									serviceName parameter to
+	 *									SecKeychainFindGenericPassword.
+	 *	@param	accountName				The value for the accountName parameter
+	 *									to SecKeychainFindGenericPassword.
+	 *	@param	expected				The password which must be found.
+	 *	@param	replacement				The value to pass to
+	 *									SecKeychainItemModifyContent if the
+	 *									expected password was found.
+	 *	@return							True if the password was replaced.
+	 *	@throws OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native boolean _compareAndSetGenericPassword(String serviceName, String accountName, String expected, String replacement)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetInternetPassword
+	 *	for the implementation of this and use {@link
+	 *	#compareAndSetInternetPassword(String, String, String, String, int,
+	 *	String, String)} to call this.
+	 *
+	 *	@param	serverName				The value which should be passed as the
+	 *									serverName parameter to
+	 *									SecKeychainFindInternetPassword.
+	 *	@param	securityDomain			The securityDomain parameter value for
+	 *									SecKeychainFindInternetPassword.
+	 *	@param	accountName				The value for the accountName parameter
+	 *									to SecKeychainFindInternetPassword.
+	 *	@param	path					The path parameter value for
+	 *									SecKeychainFindInternetPassword.
+	 *	@param	port					The port parameter value for
+	 *									SecKeychainFindInternetPassword.
+	 *	@param	expected				The password which must be found.
+	 *	@param	replacement				The value to pass to
+	 *									SecKeychainItemModifyContent if the
+	 *									expected password was found.
+	 *	@return							True if the password was replaced.
+	 *	@throws OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native boolean _compareAndSetInternetPassword(String serverName, String securityDomain, String accountName, String path, int port, String expected, String replacement)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1openSecretReader for the
+	 *	implementation of this and use {@link
+	 *	#openGenericPasswordInputStream(String, String)} to call this.
+	 *
+	 *	@param	serviceName				The value which should be passed as the
+	 *									serviceName parameter to
+	 *									SecKeychainFindGenericPassword.
+	 *	@param	accountName				The value for the accountName parameter
+	 *									to SecKeychainFindGenericPassword.
+	 *	@return							The address of the native reader.
+	 *	@throws OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native long _openSecretReader(String serviceName, String accountName)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1readSecret for the
+	 *	implementation of this.
+	 *
+	 *	@param	handle	The address of the native reader.
+	 *	@param	buffer	The buffer to copy the next part of the secret into.
+	 *	@param	offset	The offset in buffer to start copying to.
+	 *	@param	length	The maximum number of bytes to copy.
+	 *	@return			The number of bytes copied or -1 at the end of the
+	 *					secret.
+	 */
+	private native int _readSecret(long handle, byte[] buffer, int offset, int length);
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1closeSecretReader for the
+	 *	implementation of this. Wipes and frees the secret.
+	 *
+	 *	@param	handle	The address of the native reader.
+	 */
+	private native void _closeSecretReader(long handle);
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1openSecretWriter for the
+	 *	implementation of this and use {@link
+	 *	#openGenericPasswordOutputStream(String, String)} to call this.
+	 *
+	 *	@return							The address of the native writer.
+	 *	@throws OSXKeychainException	If the writer could not be allocated.
+	 */
+	private native long _openSecretWriter()
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1writeSecret for the
+	 *	implementation of this.
+	 *
+	 *	@param	handle					The address of the native writer.
+	 *	@param	buffer					The next part of the secret.
+	 *	@param	offset					The offset in buffer to copy from.
+	 *	@param	length					The number of bytes to copy.
+	 *	@throws OSXKeychainException	If the native buffer could not grow.
+	 */
+	private native void _writeSecret(long handle, byte[] buffer, int offset, int length)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1commitSecretWriter for
+	 *	the implementation of this.
+	 *
+	 *	@param	handle					The address of the native writer.
+	 *	@param	serviceName				The value which should be passed as the
+	 *									serviceName parameter to
+	 *									SecKeychainFindGenericPassword and
+	 *									SecKeychainAddGenericPassword.
+	 *	@param	accountName				The value for the accountName parameter
+	 *									to SecKeychainFindGenericPassword and
+	 *									SecKeychainAddGenericPassword.
+	 *	@throws OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native void _commitSecretWriter(long handle, String serviceName, String accountName)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1freeSecretWriter for the
+	 *	implementation of this. Wipes and frees the secret.
+	 *
+	 *	@param	handle	The address of the native writer.
+	 */
+	private native void _freeSecretWriter(long handle);
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1secretBytesPeak for the
+	 *	implementation of this and use {@link #getSecretBytesPeak(boolean)}
+	 *	to call this.
+	 *
+	 *	@param	reset	If true, start measuring a new peak.
+	 *	@return			The most bytes held at once in native secret stream
+	 *					buffers.
+	 */
+	private static native long _secretBytesPeak(boolean reset);
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1prepareGenericKey for
+	 *	the implementation of this and use {@link #prepareGenericKey(String,
+	 *	String)} to call this.
+	 *
+	 *	@param	serviceName				The service name to prepare.
+	 *	@param	accountName				The account name to prepare.
+	 *	@return							The address of the native key.
+	 *	@throws	OSXKeychainException	If the key could not be allocated.
+	 */
+	private native long _prepareGenericKey(String serviceName, String accountName)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1prepareInternetKey for
+	 *	the implementation of this and use {@link #prepareInternetKey(String,
+	 *	String, String, String, int)} to call this.
+	 *
+	 *	@param	serverName				The server name to prepare.
+	 *	@param	securityDomain			The security domain to prepare.
+	 *	@param	accountName				The account name to prepare.
+	 *	@param	path					The path to prepare.
+	 *	@param	port					The port to prepare.
+	 *	@return							The address of the native key.
+	 *	@throws	OSXKeychainException	If the key could not be allocated.
+	 */
+	private native long _prepareInternetKey(String serverName, String securityDomain, String accountName, String path, int port)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1freePreparedKey for the
+	 *	implementation of this and use {@link OSXKeychainPreparedKey#close()}
+	 *	to call this.
+	 *
+	 *	@param	key	The address of the native key to free.
+	 */
+	private static native void _freePreparedKey(long key);
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPasswordPrepared
+	 *	for the implementation of this and use {@link
+	 *	#findGenericPassword(OSXKeychainPreparedGenericKey)} to call this.
+	 *
+	 *	@param	key						The address of the native key.
+	 *	@return							The password which matches the key.
+	 *	@throws	OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native String _findGenericPasswordPrepared(long key)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1modifyGenericPasswordPrepared
+	 *	for the implementation of this and use {@link
+	 *	#modifyGenericPassword(OSXKeychainPreparedGenericKey, String)} to call
+	 *	this.
+	 *
+	 *	@param	key						The address of the native key.
+	 *	@param	password				The new password.
+	 *	@throws	OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native void _modifyGenericPasswordPrepared(long key, String password)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPasswordPrepared
+	 *	for the implementation of this and use {@link
+	 *	#deleteGenericPassword(OSXKeychainPreparedGenericKey)} to call this.
+	 *
+	 *	@param	key						The address of the native key.
+	 *	@throws	OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native void _deleteGenericPasswordPrepared(long key)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1findInternetPasswordPrepared
+	 *	for the implementation of this and use {@link
+	 *	#findInternetPassword(OSXKeychainPreparedInternetKey)} to call this.
+	 *
+	 *	@param	key						The address of the native key.
+	 *	@return							The first password which matches the
+	 *									key.
+	 *	@throws	OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native String _findInternetPasswordPrepared(long key)
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1startKeychainEvents for
+	 *	the implementation of this and use {@link
+	 *	#addKeychainListener(OSXKeychainListener)} to call this, through
+	 *	{@link #backend}. Registers a callback with SecKeychainAddCallback
+	 *	the first time it's called.
+	 *
+	 *	@throws OSXKeychainException	If the callback could not be
+	 *									registered.
+	 */
+	private native void _startKeychainEvents()
+	throws OSXKeychainException;
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1takeKeychainEvent for
+	 *	the implementation of this. Only {@link #eventDispatcher} may call
+	 *	this, through {@link #backend}.
+	 *
+	 *	@param	timeout	The maximum number of milliseconds to wait for an
+	 *					event.
+	 *	@return			The oldest queued event or null if none arrived
+	 *					within the timeout.
+	 */
+	private native OSXKeychainEvent _takeKeychainEvent(long timeout);
+
+	/** See Java_com_mcdermottroe_apple_OSXKeychain__1listItemMetadata for the
+	 *	implementation of this and use {@link #refreshIndex(File)} to call
+	 *	this.
+	 *
+	 *	@param	items					The list to add the attributes of every
+	 *									generic and internet password to.
+	 *	@throws	OSXKeychainException	If an error occurs when communicating
+	 *									with the OS X keychain.
+	 */
+	private native void _listItemMetadata(List<OSXKeychainItemMetadata> items)
+	throws OSXKeychainException;
+
 	/** Load the shared object which contains the implementations for the native
 	 *	methods in this class.
 	 *
@@ -411,6 +1368,129 @@ public class OSXKeychain {
 	/* Private utilities from here down. */
 	/* ********************************* */
 
+	/** Run a call on a worker thread and wait for it to finish, up to a
+	 *	deadline.
+	 *
+	 *	@param	<T>								The type of the result.
+	 *	@param	call							The call to make.
+	 *	@param	timeout							The longest to wait.
+	 *	@param	unit							The unit of timeout.
+	 *	@return									The result of the call.
+	 *	@throws	OSXKeychainTimeoutException		If the call did not finish
+	 *											in time.
+	 *	@throws	OSXKeychainRejectedException	If too many calls are
+	 *											already running.
+	 *	@throws	OSXKeychainException			If the call threw one, or the
+	 *											wait was interrupted.
+	 */
+	private <T> T callWithDeadline(Callable<T> call, long timeout, TimeUnit unit)
+	throws OSXKeychainException
+	{
+		Future<T> future;
+		try {
+			future = deadlineWorkers.submit(call);
+		} catch (RejectedExecutionException e) {
+			throw new OSXKeychainRejectedException("Too many keychain calls with a timeout are still running.");
+		}
+
+		try {
+			return future.get(timeout, unit);
+		} catch (TimeoutException e) {
+			timeouts.incrementAndGet();
+			throw new OSXKeychainTimeoutException("The keychain did not respond within " + timeout + " " + unit.toString().toLowerCase() + ".", future);
+		} catch (InterruptedException e) {
+			Thread.currentThread().interrupt();
+			throw new OSXKeychainException("Interrupted while waiting for the keychain.", e);
+		} catch (ExecutionException e) {
+			Throwable cause = e.getCause();
+			if (cause instanceof OSXKeychainException) {
+				throw (OSXKeychainException)cause;
+			} else if (cause instanceof RuntimeException) {
+				throw (RuntimeException)cause;
+			} else if (cause instanceof Error) {
+				throw (Error)cause;
+			}
+			throw new OSXKeychainException(cause);
+		}
+	}
+
+	/** Wait for permission to call into the keychain.
+	 *
+	 *	@param	kind							The kind of call to be made.
+	 *	@return									The limits which admitted the
+	 *											call, to be passed to {@link
+	 *											#leave(OSXKeychainAdmissionControl,
+	 *											Kind)}.
+	 *	@throws	OSXKeychainRejectedException	If the call was not admitted.
+	 *	@throws	OSXKeychainException			If the thread was interrupted
+	 *											while waiting to be admitted.
+	 */
+	private OSXKeychainAdmissionControl admit(Kind kind)
+	throws OSXKeychainException
+	{
+		OSXKeychainAdmissionControl current = admissionControl;
+		if (current != null) {
+			current.acquire(kind);
+		}
+		return current;
+	}
+
+	/** Mark a call admitted by {@link #admit(Kind)} as finished.
+	 *
+	 *	@param	admission	The value returned by {@link #admit(Kind)}.
+	 *	@param	kind		The kind of call which was made.
+	 */
+	private static void leave(OSXKeychainAdmissionControl admission, Kind kind) {
+		if (admission != null) {
+			admission.release(kind);
+		}
+	}
+
+	/** Free the native memory of a prepared key. Only {@link
+	 *	OSXKeychainPreparedKey} should call this.
+	 *
+	 *	@param	key	The address of the native key to free.
+	 */
+	static void freePreparedKey(long key) {
+		_freePreparedKey(key);
+	}
+
+	/** Get the most native memory held at once by the buffers behind
+	 *	{@link #openGenericPasswordInputStream(String, String)} and {@link
+	 *	#openGenericPasswordOutputStream(String, String)}. This doesn't
+	 *	include copies made inside the keychain itself. Used by the stream
+	 *	benchmark.
+	 *
+	 *	@param	reset	If true, the peak is reset to the amount currently held
+	 *					after it's read.
+	 *	@return			The peak, in bytes.
+	 */
+	static long getSecretBytesPeak(boolean reset) {
+		return _secretBytesPeak(reset);
+	}
+
+	/** The body of {@link #eventDispatcher}. Takes events from the backend
+	 *	and hands them to each of the listeners in turn.
+	 */
+	private void dispatchKeychainEvents() {
+		while (true) {
+			OSXKeychainEvent event = backend.takeKeychainEvent(EVENT_WAIT_MILLIS);
+			if (event == null) {
+				continue;
+			}
+			for (OSXKeychainListener listener : listeners) {
+				try {
+					listener.keychainChanged(event);
+				} catch (Throwable e) {
+					// One broken listener must not stop the others, and an
+					// Error must not kill the only thread delivering events.
+					Thread dispatcher = Thread.currentThread();
+					dispatcher.getUncaughtExceptionHandler().uncaughtException(dispatcher, e);
+				}
+			}
+		}
+	}
+
 	/** A fixed mapping of ports to known protocols. */
 	private static final Map<Integer, OSXKeychainProtocolType> PROTOCOLS;
 	static {
@@ -543,4 +1623,263 @@ public class OSXKeychain {
 		// Give up.
 		throw new OSXKeychainException("Could not determine protocol.");
 	}
+
+	/** Get the number of worker threads which are running calls made with a
+	 *	timeout, including calls which have already timed out.
+	 *
+	 *	@return	The number of busy worker threads.
+	 */
+	int getDeadlineWorkersActive() {
+		return deadlineWorkers.getActiveCount();
+	}
+
+	/* ************************************ */
+	/* The keychain backend goes down here. */
+	/* ************************************ */
+
+	/** The keychain calls made by the add and find methods and the source of
+	 *	keychain events. The parameters are the same as for the native methods
+	 *	of the same names.
+	 */
+	interface Backend {
+		void addGenericPassword(String serviceName, String accountName, String password)
+		throws OSXKeychainException;
+
+		void addInternetPassword(String serverName, String securityDomain, String accountName, String path, int port, int protocol, int authenticationType, String password)
+		throws OSXKeychainException;
+
+		String findGenericPassword(String serviceName, String accountName)
+		throws OSXKeychainException;
+
+		String findInternetPassword(String serverName, String securityDomain, String accountName, String path, int port)
+		throws OSXKeychainException;
+
+		void startKeychainEvents()
+		throws OSXKeychainException;
+
+		OSXKeychainEvent takeKeychainEvent(long timeout);
+	}
+
+	/** The real keychain, via the native methods. */
+	private final class NativeBackend
+	implements Backend
+	{
+		/** {@inheritDoc} */
+		public void addGenericPassword(String serviceName, String accountName, String password)
+		throws OSXKeychainException
+		{
+			_addGenericPassword(serviceName, accountName, password);
+		}
+
+		/** {@inheritDoc} */
+		public void addInternetPassword(String serverName, String securityDomain, String accountName, String path, int port, int protocol, int authenticationType, String password)
+		throws OSXKeychainException
+		{
+			_addInternetPassword(serverName, securityDomain, accountName, path, port, protocol, authenticationType, password);
+		}
+
+		/** {@inheritDoc} */
+		public String findGenericPassword(String serviceName, String accountName)
+		throws OSXKeychainException
+		{
+			return _findGenericPassword(serviceName, accountName);
+		}
+
+		/** {@inheritDoc} */
+		public String findInternetPassword(String serverName, String securityDomain, String accountName, String path, int port)
+		throws OSXKeychainException
+		{
+			return _findInternetPassword(serverName, securityDomain, accountName, path, port);
+		}
+
+		/** {@inheritDoc} */
+		public void startKeychainEvents()
+		throws OSXKeychainException
+		{
+			_startKeychainEvents();
+		}
+
+		/** {@inheritDoc} */
+		public OSXKeychainEvent takeKeychainEvent(long timeout) {
+			return _takeKeychainEvent(timeout);
+		}
+	}
+
+	/* ********************************** */
+	/* Streams for large secrets go here. */
+	/* ********************************** */
+
+	/** Reads a secret from a native reader. Not safe for use by more than one
+	 *	thread at a time.
+	 */
+	private final class SecretInputStream
+	extends InputStream
+	{
+		/** The address of the native reader, or 0 once closed. */
+		private long handle;
+
+		/** Wrap a native reader.
+		 *
+		 *	@param	handle	The value returned by {@link
+		 *					#_openSecretReader(String, String)}.
+		 */
+		SecretInputStream(long handle) {
+			this.handle = handle;
+		}
+
+		/** {@inheritDoc} */
+		@Override
+		public int read()
+		throws IOException
+		{
+			byte[] b = new byte[1];
+			return read(b, 0, 1) == -1 ? -1 : (b[0] & 0xff);
+		}
+
+		/** {@inheritDoc} */
+		@Override
+		public int read(byte[] b, int off, int len)
+		throws IOException
+		{
+			if (off < 0 || len < 0 || len > b.length - off) {
+				throw new IndexOutOfBoundsException();
+			}
+			if (handle == 0) {
+				throw new IOException("Stream closed.");
+			}
+			if (len == 0) {
+				return 0;
+			}
+			return _readSecret(handle, b, off, len);
+		}
+
+		/** {@inheritDoc} */
+		@Override
+		public void close() {
+			if (handle != 0) {
+				_closeSecretReader(handle);
+				handle = 0;
+			}
+		}
+
+		/** Free the native reader if the stream was never closed.
+		 *
+		 *	@throws	Throwable	If the superclass finalizer fails.
+		 */
+		@Override
+		protected void finalize()
+		throws Throwable
+		{
+			try {
+				close();
+			} finally {
+				super.finalize();
+			}
+		}
+	}
+
+	/** Collects a secret in a native writer and stores it in the keychain
+	 *	when closed. Not safe for use by more than one thread at a time.
+	 */
+	private final class SecretOutputStream
+	extends OutputStream
+	{
+		/** The address of the native writer, or 0 once closed. */
+		private long handle;
+
+		/** The service name to store the secret under. */
+		private final String serviceName;
+
+		/** The account name to store the secret under. */
+		private final String accountName;
+
+		/** Wrap a native writer.
+		 *
+		 *	@param	handle		The value returned by {@link
+		 *						#_openSecretWriter()}.
+		 *	@param	serviceName	The service name to store the secret under.
+		 *	@param	accountName	The account name to store the secret under.
+		 */
+		SecretOutputStream(long handle, String serviceName, String accountName) {
+			this.handle = handle;
+			this.serviceName = serviceName;
+			this.accountName = accountName;
+		}
+
+		/** {@inheritDoc} */
+		@Override
+		public void write(int b)
+		throws IOException
+		{
+			write(new byte[] { (byte)b }, 0, 1);
+		}
+
+		/** {@inheritDoc} */
+		@Override
+		public void write(byte[] b, int off, int len)
+		throws IOException
+		{
+			if (off < 0 || len < 0 || len > b.length - off) {
+				throw new IndexOutOfBoundsException();
+			}
+			if (handle == 0) {
+				throw new IOException("Stream closed.");
+			}
+			try {
+				_writeSecret(handle, b, off, len);
+			} catch (OSXKeychainException e) {
+				IOException ioe = new IOException(e.getMessage());
+				ioe.initCause(e);
+				throw ioe;
+			}
+		}
+
+		/** Store the secret in the keychain and free the native writer.
+		 *
+		 *	@throws	IOException	If the secret could not be stored. The cause
+		 *						will be the {@link OSXKeychainException}.
+		 */
+		@Override
+		public void close()
+		throws IOException
+		{
+			if (handle == 0) {
+				return;
+			}
+			try {
+				OSXKeychainAdmissionControl admission = admit(Kind.WRITE);
+				try {
+					_commitSecretWriter(handle, serviceName, accountName);
+				} finally {
+					leave(admission, Kind.WRITE);
+				}
+			} catch (OSXKeychainException e) {
+				IOException ioe = new IOException(e.getMessage());
+				ioe.initCause(e);
+				throw ioe;
+			} finally {
+				_freeSecretWriter(handle);
+				handle = 0;
+			}
+		}
+
+		/** Free the native writer if the stream was never closed, without
+		 *	storing the secret.
+		 *
+		 *	@throws	Throwable	If the superclass finalizer fails.
+		 */
+		@Override
+		protected void finalize()
+		throws Throwable
+		{
+			try {
+				if (handle != 0) {
+					_freeSecretWriter(handle);
+					handle = 0;
+				}
+			} finally {
+				super.finalize();
+			}
+		}
+	}
 }
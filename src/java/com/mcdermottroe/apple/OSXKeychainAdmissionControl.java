@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2011, Conor McDermottroe
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+package com.mcdermottroe.apple;
+
+import java.util.concurrent.Semaphore;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.atomic.AtomicInteger;
+import java.util.concurrent.atomic.AtomicLong;
+
+/** Limits the calls which {@link OSXKeychain} makes to the keychain so that a
+ *	burst of requests queues briefly or is turned away in the JVM rather than
+ *	piling up in securityd. Reads and writes are limited separately so that a
+ *	burst of one can't starve the other. Each kind of call has a limit on the
+ *	number running at once and a token bucket rate limit which allows bursts
+ *	of up to one second's worth of calls. Install one with {@link
+ *	OSXKeychain#setAdmissionControl(OSXKeychainAdmissionControl)}.
+ *
+ *	@author Conor McDermottroe
+ */
+public class OSXKeychainAdmissionControl {
+	/** The classes of call which are limited separately. */
+	public enum Kind {
+		/** Calls which only look things up in the keychain. */
+		READ,
+
+		/** Calls which add, modify or delete keychain items. */
+		WRITE;
+	}
+
+	/** The limits for reads. */
+	private final Gate reads;
+
+	/** The limits for writes. */
+	private final Gate writes;
+
+	/** The longest a call may wait to be admitted, in nanoseconds. */
+	private final long maxWaitNanos;
+
+	/** Create a set of limits.
+	 *
+	 *	@param	maxConcurrentReads	The most reads which may run at once, or 0
+	 *								for no limit.
+	 *	@param	readsPerSecond		The sustained rate of reads allowed, or 0
+	 *								for no limit.
+	 *	@param	maxConcurrentWrites	The most writes which may run at once, or
+	 *								0 for no limit.
+	 *	@param	writesPerSecond		The sustained rate of writes allowed, or 0
+	 *								for no limit.
+	 *	@param	maxWait				How long a call may wait to be admitted
+	 *								before it is rejected. Pass 0 to reject
+	 *								immediately when saturated.
+	 *	@param	unit				The unit of maxWait.
+	 */
+	public OSXKeychainAdmissionControl(int maxConcurrentReads, double readsPerSecond, int maxConcurrentWrites, double writesPerSecond, long maxWait, TimeUnit unit) {
+		reads = new Gate(maxConcurrentReads, readsPerSecond);
+		writes = new Gate(maxConcurrentWrites, writesPerSecond);
+		maxWaitNanos = unit.toNanos(maxWait);
+	}
+
+	/** Get the number of calls of a kind which are currently running.
+	 *
+	 *	@param	kind	The kind of call.
+	 *	@return			The number of admitted calls which have not finished.
+	 */
+	public int getInFlight(Kind kind) {
+		return gate(kind).inFlight.get();
+	}
+
+	/** Get the number of calls of a kind which are waiting to be admitted.
+	 *
+	 *	@param	kind	The kind of call.
+	 *	@return			The number of calls currently waiting.
+	 */
+	public int getQueued(Kind kind) {
+		return gate(kind).queued.get();
+	}
+
+	/** Get the number of calls of a kind which have been rejected.
+	 *
+	 *	@param	kind	The kind of call.
+	 *	@return			The total number of rejected calls.
+	 */
+	public long getRejected(Kind kind) {
+		return gate(kind).rejected.get();
+	}
+
+	/** Wait for permission to make a call. Every successful call must be
+	 *	paired with a call to {@link #release(Kind)}.
+	 *
+	 *	@param	kind							The kind of call.
+	 *	@throws	OSXKeychainRejectedException	If the call could not be
+	 *											admitted within the maximum
+	 *											wait.
+	 *	@throws	OSXKeychainException			If the thread was interrupted
+	 *											while waiting. The interrupt
+	 *											flag is set again.
+	 */
+	void acquire(Kind kind)
+	throws OSXKeychainException
+	{
+		gate(kind).acquire(kind, maxWaitNanos);
+	}
+
+	/** Mark a call admitted by {@link #acquire(Kind)} as finished.
+	 *
+	 *	@param	kind	The kind of call.
+	 */
+	void release(Kind kind) {
+		gate(kind).release();
+	}
+
+	/** Get the limits for a kind of call.
+	 *
+	 *	@param	kind	The kind of call.
+	 *	@return			The limits for that kind of call.
+	 */
+	private Gate gate(Kind kind) {
+		return kind == Kind.READ ? reads : writes;
+	}
+
+	/** The concurrency limit, rate limit and counters for one kind of call. */
+	private static final class Gate {
+		/** Permits for calls running at once, or null for no limit. */
+		private final Semaphore running;
+
+		/** Tokens added to the bucket per nanosecond, or 0 for no limit. */
+		private final double tokensPerNano;
+
+		/** The most tokens the bucket can hold. */
+		private final double burst;
+
+		/** The tokens currently in the bucket. Guarded by this. */
+		private double tokens;
+
+		/** When the bucket was last refilled. Guarded by this. */
+		private long lastRefill;
+
+		/** The number of admitted calls which have not finished. */
+		final AtomicInteger inFlight = new AtomicInteger();
+
+		/** The number of calls waiting to be admitted. */
+		final AtomicInteger queued = new AtomicInteger();
+
+		/** The total number of rejected calls. */
+		final AtomicLong rejected = new AtomicLong();
+
+		/** Create the limits for one kind of call.
+		 *
+		 *	@param	maxConcurrent	The most calls which may run at once, or 0
+		 *							for no limit.
+		 *	@param	perSecond		The sustained rate of calls allowed, or 0
+		 *							for no limit.
+		 */
+		Gate(int maxConcurrent, double perSecond) {
+			running = maxConcurrent > 0 ? new Semaphore(maxConcurrent, true) : null;
+			tokensPerNano = perSecond > 0 ? perSecond / TimeUnit.SECONDS.toNanos(1) : 0;
+			burst = Math.max(1, perSecond);
+			tokens = burst;
+			lastRefill = System.nanoTime();
+		}
+
+		/** Wait for a token and a running permit. If the permit can't be
+		 *	had the token is put back, so a saturated concurrency limit
+		 *	doesn't also use up the rate limit.
+		 *
+		 *	@param	kind							The kind of call, for the
+		 *											exception message.
+		 *	@param	maxWaitNanos					The longest to wait.
+		 *	@throws	OSXKeychainRejectedException	If the call could not be
+		 *											admitted in time.
+		 *	@throws	OSXKeychainException			If the thread was
+		 *											interrupted while waiting.
+		 */
+		void acquire(Kind kind, long maxWaitNanos)
+		throws OSXKeychainException
+		{
+			long deadline = System.nanoTime() + maxWaitNanos;
+			boolean admitted = false;
+
+			queued.incrementAndGet();
+			try {
+				if (takeToken(deadline)) {
+					if (running == null) {
+						admitted = true;
+					} else {
+						long remaining = deadline - System.nanoTime();
+						try {
+							admitted = running.tryAcquire(Math.max(0, remaining), TimeUnit.NANOSECONDS);
+						} finally {
+							if (!admitted) {
+								returnToken();
+							}
+						}
+					}
+				}
+			} catch (InterruptedException e) {
+				Thread.currentThread().interrupt();
+				throw new OSXKeychainException("Interrupted while waiting to make a keychain " + kind.toString().toLowerCase() + ".", e);
+			} finally {
+				queued.decrementAndGet();
+			}
+
+			if (!admitted) {
+				rejected.incrementAndGet();
+				throw new OSXKeychainRejectedException("Keychain " + kind.toString().toLowerCase() + " rejected, the admission limits are saturated.");
+			}
+			inFlight.incrementAndGet();
+		}
+
+		/** Mark an admitted call as finished. */
+		void release() {
+			inFlight.decrementAndGet();
+			if (running != null) {
+				running.release();
+			}
+		}
+
+		/** Put back a token taken by {@link #takeToken(long)} for a call
+		 *	which was not admitted.
+		 */
+		private void returnToken() {
+			if (tokensPerNano == 0) {
+				return;
+			}
+			synchronized (this) {
+				tokens = Math.min(burst, tokens + 1);
+			}
+		}
+
+		/** Take a token from the bucket, waiting for one to be added if
+		 *	necessary.
+		 *
+		 *	@param	deadline				The value of System.nanoTime() after
+		 *									which to give up.
+		 *	@return							True if a token was taken.
+		 *	@throws	InterruptedException	If interrupted while waiting.
+		 */
+		private boolean takeToken(long deadline)
+		throws InterruptedException
+		{
+			if (tokensPerNano == 0) {
+				return true;
+			}
+			while (true) {
+				long wait;
+				long now = System.nanoTime();
+				synchronized (this) {
+					tokens = Math.min(burst, tokens + (now - lastRefill) * tokensPerNano);
+					lastRefill = now;
+					if (tokens >= 1) {
+						tokens -= 1;
+						return true;
+					}
+					wait = (long)Math.ceil((1 - tokens) / tokensPerNano);
+				}
+				if (now + wait > deadline) {
+					return false;
+				}
+				TimeUnit.NANOSECONDS.sleep(wait);
+			}
+		}
+	}
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2011, Conor McDermottroe
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+package com.mcdermottroe.apple;
+
+/** A change to an item in the keychain, delivered to any registered
+ *	{@link OSXKeychainListener}. The names of the item are filled in where
+ *	the keychain makes them available. Items which have been deleted often
+ *	can't be read any more, so listeners should treat an event with no names
+ *	as meaning that any item may have changed.
+ *
+ *	@author Conor McDermottroe
+ */
+public class OSXKeychainEvent {
+	/** The kinds of change which can happen to a keychain item. */
+	public enum Type {
+		/** An item was added to the keychain. */
+		ADDED,
+
+		/** An existing item was modified. */
+		UPDATED,
+
+		/** An item was deleted from the keychain. */
+		DELETED;
+	}
+
+	/** The kind of change. */
+	private final Type type;
+
+	/** The service name of the generic password which changed. */
+	private final String serviceName;
+
+	/** The account name of the item which changed. */
+	private final String accountName;
+
+	/** The server name of the internet password which changed. */
+	private final String serverName;
+
+	/** Create an event. This is called from the native code, the values for
+	 *	type are the ordinals of {@link Type}.
+	 *
+	 *	@param	type		The ordinal of the {@link Type} of the change.
+	 *	@param	serviceName	The service name of a generic password or null.
+	 *	@param	accountName	The account name of the item or null.
+	 *	@param	serverName	The server name of an internet password or null.
+	 */
+	OSXKeychainEvent(int type, String serviceName, String accountName, String serverName) {
+		this.type = Type.values()[type];
+		this.serviceName = serviceName;
+		this.accountName = accountName;
+		this.serverName = serverName;
+	}
+
+	/** Get the kind of change which happened.
+	 *
+	 *	@return	The type of the event.
+	 */
+	public Type getType() {
+		return type;
+	}
+
+	/** Get the service name of the generic password which changed.
+	 *
+	 *	@return	The service name, or null if the item was not a generic
+	 *			password or the name is not known.
+	 */
+	public String getServiceName() {
+		return serviceName;
+	}
+
+	/** Get the account name of the item which changed.
+	 *
+	 *	@return	The account name, or null if it is not known.
+	 */
+	public String getAccountName() {
+		return accountName;
+	}
+
+	/** Get the server name of the internet password which changed.
+	 *
+	 *	@return	The server name, or null if the item was not an internet
+	 *			password or the name is not known.
+	 */
+	public String getServerName() {
+		return serverName;
+	}
+
+	/** {@inheritDoc} */
+	@Override
+	public String toString() {
+		return type + "(service=" + serviceName + ", account=" + accountName + ", server=" + serverName + ")";
+	}
+}
@@ -0,0 +1,552 @@
+/*
+ * Copyright (c) 2011, Conor McDermottroe
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+package com.mcdermottroe.apple;
+
+import java.io.File;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.io.UnsupportedEncodingException;
+import java.nio.ByteBuffer;
+import java.nio.channels.FileChannel;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.Comparator;
+import java.util.List;
+
+/** A sorted, memory-mapped file of the non-secret details of the items in the
+ *	keychain. It can be opened and queried by service or server name without
+ *	loading the native library or walking the keychain, which makes it
+ *	suitable for answering "which accounts exist for service X" at startup.
+ *	Passwords are never written to the index. Create or update one with
+ *	{@link OSXKeychain#refreshIndex(File)} and open an existing one with
+ *	{@link #open(File)}.
+ *
+ *	<p>The file is a header, followed by fixed size records sorted by name,
+ *	followed by the UTF-8 bytes of the strings which the records point at.
+ *	Queries binary search the records in the mapped file and only decode the
+ *	records which match. All integers are big-endian.</p>
+ *
+ *	@author Conor McDermottroe
+ */
+public final class OSXKeychainIndex {
+	/** The first bytes of every index file. */
+	private static final byte[] MAGIC = { 'O', 'S', 'X', 'K', 'C', 'I', 'D', 'X' };
+
+	/** The version of the file format. */
+	private static final int VERSION = 1;
+
+	/** The offset of the format version in the header. */
+	private static final int H_VERSION = 8;
+
+	/** The offset of the number of records in the header. */
+	private static final int H_COUNT = 12;
+
+	/** The offset of the newest modification time in the header. */
+	private static final int H_NEWEST = 16;
+
+	/** The offset of the size of the whole file in the header. */
+	private static final int H_SIZE = 24;
+
+	/** The size of the header. */
+	private static final int HEADER_SIZE = 32;
+
+	/** The offsets of the fields in a record. Strings are stored as an
+	 *	absolute offset into the file and a length.
+	 */
+	private static final int R_INTERNET = 0;
+	private static final int R_NAME = 4;
+	private static final int R_ACCOUNT = 12;
+	private static final int R_PATH = 20;
+	private static final int R_PORT = 28;
+	private static final int R_PROTOCOL = 32;
+	private static final int R_MODIFIED = 40;
+
+	/** The size of a record. */
+	private static final int RECORD_SIZE = 48;
+
+	/** The mapped file. Only absolute gets are used on it so that it can be
+	 *	shared between threads.
+	 */
+	private final ByteBuffer buffer;
+
+	/** The number of records in the index. */
+	private final int count;
+
+	/** Wrap a mapped index file, checking that it's valid.
+	 *
+	 *	@param	buffer					The contents of the file.
+	 *	@throws	OSXKeychainException	If the file is not a valid index.
+	 */
+	private OSXKeychainIndex(ByteBuffer buffer)
+	throws OSXKeychainException
+	{
+		this.buffer = buffer;
+		if (buffer.capacity() < HEADER_SIZE) {
+			throw new OSXKeychainException("Keychain index is truncated.");
+		}
+		for (int i = 0; i < MAGIC.length; i++) {
+			if (buffer.get(i) != MAGIC[i]) {
+				throw new OSXKeychainException("Not a keychain index.");
+			}
+		}
+		if (buffer.getInt(H_VERSION) != VERSION) {
+			throw new OSXKeychainException("Unsupported keychain index version " + buffer.getInt(H_VERSION) + ".");
+		}
+		count = buffer.getInt(H_COUNT);
+		if (count < 0 || buffer.getLong(H_SIZE) != buffer.capacity() || HEADER_SIZE + (long)count * RECORD_SIZE > buffer.capacity()) {
+			throw new OSXKeychainException("Keychain index is corrupt.");
+		}
+
+		// Queries trust the string pointers, so check them all now rather
+		// than fail part way through a query.
+		int strings = HEADER_SIZE + count * RECORD_SIZE;
+		for (int i = 0; i < count; i++) {
+			int record = HEADER_SIZE + i * RECORD_SIZE;
+			checkString(record + R_NAME, strings, i);
+			checkString(record + R_ACCOUNT, strings, i);
+			checkString(record + R_PATH, strings, i);
+		}
+	}
+
+	/** Check that a string in a record lies within the string area.
+	 *
+	 *	@param	field					The absolute offset of the string's
+	 *									offset and length.
+	 *	@param	strings					The offset of the string area.
+	 *	@param	index					The index of the record, for the error
+	 *									message.
+	 *	@throws	OSXKeychainException	If the string is out of bounds.
+	 */
+	private void checkString(int field, int strings, int index)
+	throws OSXKeychainException
+	{
+		int offset = buffer.getInt(field);
+		int length = buffer.getInt(field + 4);
+		if (offset < strings || length < 0 || (long)offset + length > buffer.capacity()) {
+			throw new OSXKeychainException("Keychain index record " + index + " is corrupt.");
+		}
+	}
+
+	/** Open an existing index file. The file is mapped, not read, so this
+	 *	takes the same time however big the index is.
+	 *
+	 *	@param	file					The index file.
+	 *	@return							The index.
+	 *	@throws	OSXKeychainException	If the file can't be read or is not a
+	 *									valid index.
+	 */
+	public static OSXKeychainIndex open(File file)
+	throws OSXKeychainException
+	{
+		try {
+			RandomAccessFile raf = new RandomAccessFile(file, "r");
+			try {
+				FileChannel channel = raf.getChannel();
+				// The mapping remains valid after the file is closed.
+				return new OSXKeychainIndex(channel.map(FileChannel.MapMode.READ_ONLY, 0, channel.size()));
+			} finally {
+				raf.close();
+			}
+		} catch (IOException e) {
+			throw new OSXKeychainException("Failed to open keychain index " + file, e);
+		}
+	}
+
+	/** Get the number of items in the index.
+	 *
+	 *	@return	The number of items.
+	 */
+	public int size() {
+		return count;
+	}
+
+	/** Get the most recent modification time of any item in the index.
+	 *
+	 *	@return	The time in milliseconds since the epoch.
+	 */
+	public long getNewestModificationTime() {
+		return buffer.getLong(H_NEWEST);
+	}
+
+	/** Get an item from the index.
+	 *
+	 *	@param	index	The position of the item, in order of name.
+	 *	@return			The item.
+	 */
+	public OSXKeychainItemMetadata get(int index) {
+		if (index < 0 || index >= count) {
+			throw new IndexOutOfBoundsException(String.valueOf(index));
+		}
+		int record = HEADER_SIZE + index * RECORD_SIZE;
+		return new OSXKeychainItemMetadata(
+			buffer.getInt(record + R_INTERNET) != 0,
+			readString(record + R_NAME),
+			readString(record + R_ACCOUNT),
+			readString(record + R_PATH),
+			buffer.getInt(record + R_PORT),
+			buffer.getInt(record + R_PROTOCOL),
+			buffer.getLong(record + R_MODIFIED)
+		);
+	}
+
+	/** Find all the items whose service or server name starts with a prefix.
+	 *
+	 *	@param	prefix	The start of the name. "" matches everything.
+	 *	@return			The matching items, in order of name.
+	 */
+	public List<OSXKeychainItemMetadata> findByPrefix(String prefix) {
+		byte[] key = utf8(prefix);
+		List<OSXKeychainItemMetadata> result = new ArrayList<OSXKeychainItemMetadata>();
+		for (int i = lowerBound(key); i < count && compareName(i, key, true) == 0; i++) {
+			result.add(get(i));
+		}
+		return result;
+	}
+
+	/** Find all the items whose service or server name is in a range.
+	 *
+	 *	@param	from	The lowest name to include, or null to start at the
+	 *					beginning.
+	 *	@param	to		The name to stop before, or null to go to the end.
+	 *	@return			The matching items, in order of name.
+	 */
+	public List<OSXKeychainItemMetadata> findByRange(String from, String to) {
+		int start = from == null ? 0 : lowerBound(utf8(from));
+		int end = to == null ? count : lowerBound(utf8(to));
+		List<OSXKeychainItemMetadata> result = new ArrayList<OSXKeychainItemMetadata>();
+		for (int i = start; i < end; i++) {
+			result.add(get(i));
+		}
+		return result;
+	}
+
+	/** Write a new index file, replacing any existing one atomically.
+	 *
+	 *	@param	file					The index file.
+	 *	@param	items					The items to put in the index.
+	 *	@return							The new index.
+	 *	@throws	OSXKeychainException	If the file can't be written.
+	 */
+	static OSXKeychainIndex write(File file, List<OSXKeychainItemMetadata> items)
+	throws OSXKeychainException
+	{
+		List<Entry> entries = sort(items);
+
+		// Work out where everything goes.
+		long size = HEADER_SIZE + (long)entries.size() * RECORD_SIZE;
+		long newest = 0;
+		for (Entry e : entries) {
+			size += e.name.length + e.account.length + e.path.length;
+			newest = Math.max(newest, e.metadata.getModificationTime());
+		}
+		if (size > Integer.MAX_VALUE) {
+			throw new OSXKeychainException("Keychain index is too large.");
+		}
+
+		ByteBuffer out = ByteBuffer.allocate((int)size);
+		out.put(MAGIC);
+		out.putInt(H_VERSION, VERSION);
+		out.putInt(H_COUNT, entries.size());
+		out.putLong(H_NEWEST, newest);
+		out.putLong(H_SIZE, size);
+		int strings = HEADER_SIZE + entries.size() * RECORD_SIZE;
+		for (int i = 0; i < entries.size(); i++) {
+			Entry e = entries.get(i);
+			int record = HEADER_SIZE + i * RECORD_SIZE;
+			out.putInt(record + R_INTERNET, e.metadata.isInternetPassword() ? 1 : 0);
+			strings = putString(out, record + R_NAME, strings, e.name);
+			strings = putString(out, record + R_ACCOUNT, strings, e.account);
+			strings = putString(out, record + R_PATH, strings, e.path);
+			out.putInt(record + R_PORT, e.metadata.getPort());
+			out.putInt(record + R_PROTOCOL, e.metadata.getProtocolValue());
+			out.putLong(record + R_MODIFIED, e.metadata.getModificationTime());
+		}
+
+		// Write to a uniquely named temporary file beside the index and
+		// rename it over the index so readers never see a partial index and
+		// concurrent writers never share a temporary file. The temporary
+		// file is in the same directory so the rename is a single atomic
+		// rename(2) rather than a copy across file systems.
+		File tmp = null;
+		boolean moved = false;
+		try {
+			tmp = File.createTempFile(file.getName(), ".tmp", file.getAbsoluteFile().getParentFile());
+			FileOutputStream stream = new FileOutputStream(tmp);
+			try {
+				stream.write(out.array());
+				stream.getFD().sync();
+			} finally {
+				stream.close();
+			}
+			if (!tmp.renameTo(file)) {
+				throw new IOException("Failed to rename " + tmp + " to " + file);
+			}
+			moved = true;
+		} catch (IOException e) {
+			throw new OSXKeychainException("Failed to write keychain index " + file, e);
+		} finally {
+			if (tmp != null && !moved) {
+				tmp.delete();
+			}
+		}
+		return open(file);
+	}
+
+	/** Check whether the index holds exactly a set of items, including their
+	 *	modification times.
+	 *
+	 *	@param	items	The items currently in the keychain.
+	 *	@return			True if the index is up to date with the items.
+	 */
+	boolean isCurrent(List<OSXKeychainItemMetadata> items) {
+		if (items.size() != count) {
+			return false;
+		}
+		List<Entry> entries = sort(items);
+		for (int i = 0; i < count; i++) {
+			Entry e = entries.get(i);
+			int record = HEADER_SIZE + i * RECORD_SIZE;
+			if ((buffer.getInt(record + R_INTERNET) != 0) != e.metadata.isInternetPassword() ||
+				buffer.getLong(record + R_MODIFIED) != e.metadata.getModificationTime() ||
+				buffer.getInt(record + R_PORT) != e.metadata.getPort() ||
+				buffer.getInt(record + R_PROTOCOL) != e.metadata.getProtocolValue() ||
+				!stringEquals(record + R_NAME, e.name) ||
+				!stringEquals(record + R_ACCOUNT, e.account) ||
+				!stringEquals(record + R_PATH, e.path)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** Find the first record whose name is not less than a key.
+	 *
+	 *	@param	key	The UTF-8 bytes of the name to look for.
+	 *	@return		The index of the record, or {@link #count} if every name
+	 *				is less than the key.
+	 */
+	private int lowerBound(byte[] key) {
+		int lo = 0;
+		int hi = count;
+		while (lo < hi) {
+			int mid = (lo + hi) >>> 1;
+			if (compareName(mid, key, false) < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+
+	/** Compare the name of a record with a key, byte by byte, without
+	 *	decoding it.
+	 *
+	 *	@param	index	The index of the record.
+	 *	@param	key		The UTF-8 bytes to compare with.
+	 *	@param	prefix	If true, a name which starts with the key compares
+	 *					equal to it.
+	 *	@return			Less than, equal to or greater than zero as the name
+	 *					is less than, equal to or greater than the key.
+	 */
+	private int compareName(int index, byte[] key, boolean prefix) {
+		int record = HEADER_SIZE + index * RECORD_SIZE;
+		int offset = buffer.getInt(record + R_NAME);
+		int length = buffer.getInt(record + R_NAME + 4);
+		for (int i = 0; i < length && i < key.length; i++) {
+			int diff = (buffer.get(offset + i) & 0xff) - (key[i] & 0xff);
+			if (diff != 0) {
+				return diff;
+			}
+		}
+		if (prefix && length >= key.length) {
+			return 0;
+		}
+		return length - key.length;
+	}
+
+	/** Check whether a string in a record matches some bytes.
+	 *
+	 *	@param	field	The absolute offset of the string's offset and length.
+	 *	@param	value	The bytes to compare with.
+	 *	@return			True if they're the same.
+	 */
+	private boolean stringEquals(int field, byte[] value) {
+		int offset = buffer.getInt(field);
+		int length = buffer.getInt(field + 4);
+		if (length != value.length) {
+			return false;
+		}
+		for (int i = 0; i < length; i++) {
+			if (buffer.get(offset + i) != value[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/** Decode a string from a record.
+	 *
+	 *	@param	field	The absolute offset of the string's offset and length.
+	 *	@return			The string.
+	 */
+	private String readString(int field) {
+		byte[] bytes = new byte[buffer.getInt(field + 4)];
+		int offset = buffer.getInt(field);
+		for (int i = 0; i < bytes.length; i++) {
+			bytes[i] = buffer.get(offset + i);
+		}
+		try {
+			return new String(bytes, "UTF-8");
+		} catch (UnsupportedEncodingException e) {
+			throw new IllegalStateException(e);
+		}
+	}
+
+	/** Store a string in the string area and point a record field at it.
+	 *
+	 *	@param	out		The buffer being written.
+	 *	@param	field	The absolute offset of the field in the record.
+	 *	@param	offset	Where to put the string.
+	 *	@param	value	The bytes of the string.
+	 *	@return			Where to put the next string.
+	 */
+	private static int putString(ByteBuffer out, int field, int offset, byte[] value) {
+		out.putInt(field, offset);
+		out.putInt(field + 4, value.length);
+		for (int i = 0; i < value.length; i++) {
+			out.put(offset + i, value[i]);
+		}
+		return offset + value.length;
+	}
+
+	/** Encode a string as UTF-8.
+	 *
+	 *	@param	s	The string.
+	 *	@return		The UTF-8 bytes.
+	 */
+	private static byte[] utf8(String s) {
+		try {
+			return s.getBytes("UTF-8");
+		} catch (UnsupportedEncodingException e) {
+			throw new IllegalStateException(e);
+		}
+	}
+
+	/** Encode and sort items in the order they're stored in the index.
+	 *
+	 *	@param	items	The items.
+	 *	@return			The encoded items, sorted.
+	 */
+	private static List<Entry> sort(List<OSXKeychainItemMetadata> items) {
+		List<Entry> entries = new ArrayList<Entry>(items.size());
+		for (OSXKeychainItemMetadata item : items) {
+			entries.add(new Entry(item));
+		}
+		Collections.sort(entries, ENTRY_ORDER);
+		return entries;
+	}
+
+	/** Compare two byte arrays as unsigned bytes.
+	 *
+	 *	@param	a	The first array.
+	 *	@param	b	The second array.
+	 *	@return		Less than, equal to or greater than zero as a is less
+	 *				than, equal to or greater than b.
+	 */
+	private static int compareBytes(byte[] a, byte[] b) {
+		for (int i = 0; i < a.length && i < b.length; i++) {
+			int diff = (a[i] & 0xff) - (b[i] & 0xff);
+			if (diff != 0) {
+				return diff;
+			}
+		}
+		return a.length - b.length;
+	}
+
+	/** Compare two ints without the overflow of subtracting them.
+	 *
+	 *	@param	a	The first int.
+	 *	@param	b	The second int.
+	 *	@return		-1, 0 or 1 as a is less than, equal to or greater than b.
+	 */
+	private static int compareInts(int a, int b) {
+		return a < b ? -1 : (a == b ? 0 : 1);
+	}
+
+	/** The order of the records: name first, as queries need, then the rest
+	 *	of the item's identity so that the order is stable.
+	 */
+	private static final Comparator<Entry> ENTRY_ORDER = new Comparator<Entry>() {
+		public int compare(Entry a, Entry b) {
+			int c = compareBytes(a.name, b.name);
+			if (c == 0) {
+				c = compareBytes(a.account, b.account);
+			}
+			if (c == 0) {
+				c = compareBytes(a.path, b.path);
+			}
+			if (c == 0) {
+				c = (a.metadata.isInternetPassword() ? 1 : 0) - (b.metadata.isInternetPassword() ? 1 : 0);
+			}
+			if (c == 0) {
+				c = compareInts(a.metadata.getPort(), b.metadata.getPort());
+			}
+			if (c == 0) {
+				c = compareInts(a.metadata.getProtocolValue(), b.metadata.getProtocolValue());
+			}
+			return c;
+		}
+	};
+
+	/** An item with its strings encoded, ready to be sorted and written. */
+	private static final class Entry {
+		/** The item. */
+		final OSXKeychainItemMetadata metadata;
+
+		/** The UTF-8 service or server name. */
+		final byte[] name;
+
+		/** The UTF-8 account name. */
+		final byte[] account;
+
+		/** The UTF-8 path. */
+		final byte[] path;
+
+		/** Encode an item.
+		 *
+		 *	@param	metadata	The item.
+		 */
+		Entry(OSXKeychainItemMetadata metadata) {
+			this.metadata = metadata;
+			name = utf8(metadata.getName());
+			account = utf8(metadata.getAccountName());
+			path = utf8(metadata.getPath());
+		}
+	}
+}
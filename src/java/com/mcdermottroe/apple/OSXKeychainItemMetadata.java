@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2011, Conor McDermottroe
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+package com.mcdermottroe.apple;
+
+/** The non-secret details of an item in the keychain, as stored in an
+ *	{@link OSXKeychainIndex}. Never contains the password itself.
+ *
+ *	@author Conor McDermottroe
+ */
+public class OSXKeychainItemMetadata {
+	/** True for an internet password, false for a generic password. */
+	private final boolean internet;
+
+	/** The service name of a generic password or the server name of an
+	 *	internet password.
+	 */
+	private final String name;
+
+	/** The account name. */
+	private final String accountName;
+
+	/** The path of an internet password. */
+	private final String path;
+
+	/** The port of an internet password. */
+	private final int port;
+
+	/** The raw protocol value of an internet password. */
+	private final int protocol;
+
+	/** When the item was last modified, in milliseconds since the epoch. */
+	private final long modificationTime;
+
+	/** Create the metadata for an item. This is called from the native code
+	 *	and when reading an index.
+	 *
+	 *	@param	internet			True for an internet password.
+	 *	@param	name				The service or server name.
+	 *	@param	accountName			The account name.
+	 *	@param	path				The path of an internet password or null.
+	 *	@param	port				The port of an internet password or 0.
+	 *	@param	protocol			The raw protocol value or 0.
+	 *	@param	modificationTime	When the item was last modified, in
+	 *								milliseconds since the epoch.
+	 */
+	OSXKeychainItemMetadata(boolean internet, String name, String accountName, String path, int port, int protocol, long modificationTime) {
+		this.internet = internet;
+		this.name = name == null ? "" : name;
+		this.accountName = accountName == null ? "" : accountName;
+		this.path = path == null ? "" : path;
+		this.port = port;
+		this.protocol = protocol;
+		this.modificationTime = modificationTime;
+	}
+
+	/** Check whether the item is an internet password.
+	 *
+	 *	@return	True for an internet password, false for a generic password.
+	 */
+	public boolean isInternetPassword() {
+		return internet;
+	}
+
+	/** Get the service name of a generic password.
+	 *
+	 *	@return	The service name, or null for an internet password.
+	 */
+	public String getServiceName() {
+		return internet ? null : name;
+	}
+
+	/** Get the server name of an internet password.
+	 *
+	 *	@return	The server name, or null for a generic password.
+	 */
+	public String getServerName() {
+		return internet ? name : null;
+	}
+
+	/** Get the account name.
+	 *
+	 *	@return	The account name, or "" if the item has none.
+	 */
+	public String getAccountName() {
+		return accountName;
+	}
+
+	/** Get the path of an internet password.
+	 *
+	 *	@return	The path, or "" if the item has none.
+	 */
+	public String getPath() {
+		return path;
+	}
+
+	/** Get the port of an internet password.
+	 *
+	 *	@return	The port, or 0 if the item has none.
+	 */
+	public int getPort() {
+		return port;
+	}
+
+	/** Get the protocol of an internet password.
+	 *
+	 *	@return	The protocol, or null if the item has none or it is not one
+	 *			of the known protocols.
+	 */
+	public OSXKeychainProtocolType getProtocol() {
+		for (OSXKeychainProtocolType pt : OSXKeychainProtocolType.values()) {
+			if (pt.getValue() == protocol) {
+				return pt;
+			}
+		}
+		return null;
+	}
+
+	/** Get when the item was last modified.
+	 *
+	 *	@return	The modification time in milliseconds since the epoch, or 0
+	 *			if it is not known.
+	 */
+	public long getModificationTime() {
+		return modificationTime;
+	}
+
+	/** Get the service or server name, whichever applies.
+	 *
+	 *	@return	The name the index is sorted by.
+	 */
+	String getName() {
+		return name;
+	}
+
+	/** Get the raw protocol value.
+	 *
+	 *	@return	The protocol as stored in the keychain.
+	 */
+	int getProtocolValue() {
+		return protocol;
+	}
+
+	/** {@inheritDoc} */
+	@Override
+	public String toString() {
+		if (internet) {
+			return accountName + "@" + name + ":" + port + path;
+		}
+		return accountName + "@" + name;
+	}
+}
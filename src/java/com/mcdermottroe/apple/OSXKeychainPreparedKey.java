@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2011, Conor McDermottroe
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+package com.mcdermottroe.apple;
+
+import java.io.Closeable;
+import java.util.concurrent.atomic.AtomicBoolean;
+import java.util.concurrent.atomic.AtomicInteger;
+
+/** The identifying fields of a keychain item, converted to the keychain's
+ *	encoding once and held in native memory so that repeated lookups don't
+ *	need to convert them again. Call {@link #close()} to free the native
+ *	memory as soon as the key is no longer needed. A key may be used from
+ *	several threads at once and closing it while it is in use is safe, the
+ *	memory is freed when the last use finishes.
+ *
+ *	@author Conor McDermottroe
+ */
+public abstract class OSXKeychainPreparedKey
+implements Closeable
+{
+	/** The address of the native prepared_key. */
+	private final long handle;
+
+	/** One for the owner of the key until it is closed, plus one for each
+	 *	call currently using {@link #handle}. The native memory is freed when
+	 *	this reaches zero.
+	 */
+	private final AtomicInteger references = new AtomicInteger(1);
+
+	/** Whether {@link #close()} has been called. */
+	private final AtomicBoolean closed = new AtomicBoolean(false);
+
+	/** Wrap a native prepared key.
+	 *
+	 *	@param	handle	The value returned by one of the native
+	 *					_prepare*Key methods in {@link OSXKeychain}.
+	 */
+	OSXKeychainPreparedKey(long handle) {
+		this.handle = handle;
+	}
+
+	/** Free the native memory held by this key. The key may not be used
+	 *	after this has been called. Calling this more than once has no
+	 *	effect.
+	 */
+	public void close() {
+		if (closed.compareAndSet(false, true)) {
+			release();
+		}
+	}
+
+	/** Mark the key as in use and get the native handle. Every successful
+	 *	call must be paired with a call to {@link #release()}.
+	 *
+	 *	@return							The native handle for the key.
+	 *	@throws	OSXKeychainException	If the key has been closed.
+	 */
+	long acquire()
+	throws OSXKeychainException
+	{
+		while (true) {
+			// Calls still in flight keep the reference count up after
+			// close(), so check the flag too.
+			int current = references.get();
+			if (closed.get() || current <= 0) {
+				throw new OSXKeychainException("The prepared key has been closed.");
+			}
+			if (references.compareAndSet(current, current + 1)) {
+				return handle;
+			}
+		}
+	}
+
+	/** Finish using the native handle, freeing it if the key has been closed
+	 *	and this was the last use.
+	 */
+	void release() {
+		if (references.decrementAndGet() == 0) {
+			OSXKeychain.freePreparedKey(handle);
+		}
+	}
+
+	/** Free the native memory if the key was never closed.
+	 *
+	 *	@throws	Throwable	If the superclass finalizer fails.
+	 */
+	@Override
+	protected void finalize()
+	throws Throwable
+	{
+		try {
+			close();
+		} finally {
+			super.finalize();
+		}
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2011, Conor McDermottroe
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+package com.mcdermottroe.apple;
+
+import java.util.concurrent.Future;
+
+/** Thrown when a call to the keychain made with a timeout does not finish in
+ *	time. The call carries on in the background; its eventual result, or the
+ *	exception it throws, is available from {@link #getLateResult()}.
+ *
+ *	@author Conor McDermottroe
+ */
+public class OSXKeychainTimeoutException
+extends OSXKeychainException
+{
+	/** The call which timed out. */
+	private final transient Future<?> lateResult;
+
+	/** Create an exception for a call which timed out.
+	 *
+	 *	@param	message		A message explaining which deadline was missed.
+	 *	@param	lateResult	The call which is still running.
+	 */
+	public OSXKeychainTimeoutException(String message, Future<?> lateResult) {
+		super(message);
+		this.lateResult = lateResult;
+	}
+
+	/** Get the call which timed out, so that its result can be collected or
+	 *	checked once it finishes. Cancelling it has no effect on a call which
+	 *	is already inside the keychain.
+	 *
+	 *	@return	The call which is still running.
+	 */
+	public Future<?> getLateResult() {
+		return lateResult;
+	}
+}
@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2011, Conor McDermottroe
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Count every allocation and release made by the native code and check
+ * that each entry point makes exactly the number we expect. After that, run
+ * the read paths in a loop and report anything left outstanding. The number
+ * of iterations of the loop can be passed as the only argument.
+ */
+
+#include <libkern/OSAtomic.h>
+#include <mach/mach.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <Security/Security.h>
+
+#include "fakejni.h"
+
+#define SERVICE_NAME "Test OS X Keychain from Java"
+#define USERNAME "Test OS X Keychain User"
+#define PASSWORD "Test OS X Keychain Password"
+#define NEW_PASSWORD "Test OS X Keychain New Password"
+#define SERVER_NAME "test.osxkeychain.example.com"
+#define SECURITY_DOMAIN "Test OS X Keychain Domain"
+#define SERVER_PATH "/test"
+#define SOAK_ITERATIONS 1000000
+
+/* The number of allocations and releases of each kind made by the native
+ * code since the counts were last checked.
+ */
+typedef struct {
+	long mallocs;
+	long frees;
+	long utf_chars;
+	long utf_releases;
+	long new_strings;
+	long new_objects;
+	long refs;
+	long ref_releases;
+	long contents;
+	long content_frees;
+} alloc_counts;
+
+static alloc_counts counts;
+
+/* The unwrapped fakejni functions. */
+static fakejni_env real_env;
+
+/* Counting versions of the allocator. */
+static void* counting_malloc(size_t size) {
+	counts.mallocs++;
+	return malloc(size);
+}
+
+static void* counting_calloc(size_t count, size_t size) {
+	counts.mallocs++;
+	return calloc(count, size);
+}
+
+static void counting_free(void* ptr) {
+	if (ptr != NULL) {
+		counts.frees++;
+	}
+	free(ptr);
+}
+
+/* Counting versions of the keychain calls which hand us something we must
+ * release. Item and search refs must be passed to CFRelease and password
+ * data or attributes must be passed to SecKeychainItemFreeContent.
+ */
+static void counting_CFRelease(CFTypeRef ref) {
+	counts.ref_releases++;
+	CFRelease(ref);
+}
+
+static OSStatus counting_SecKeychainFindGenericPassword(CFTypeRef keychainOrArray, UInt32 serviceNameLength, const char* serviceName, UInt32 accountNameLength, const char* accountName, UInt32* passwordLength, void** passwordData, SecKeychainItemRef* itemRef) {
+	OSStatus status = SecKeychainFindGenericPassword(keychainOrArray, serviceNameLength, serviceName, accountNameLength, accountName, passwordLength, passwordData, itemRef);
+
+	if (status == errSecSuccess) {
+		counts.contents += passwordData != NULL;
+		counts.refs += itemRef != NULL;
+	}
+	return status;
+}
+
+static OSStatus counting_SecKeychainFindInternetPassword(CFTypeRef keychainOrArray, UInt32 serverNameLength, const char* serverName, UInt32 securityDomainLength, const char* securityDomain, UInt32 accountNameLength, const char* accountName, UInt32 pathLength, const char* path, UInt16 port, SecProtocolType protocol, SecAuthenticationType authenticationType, UInt32* passwordLength, void** passwordData, SecKeychainItemRef* itemRef) {
+	OSStatus status = SecKeychainFindInternetPassword(keychainOrArray, serverNameLength, serverName, securityDomainLength, securityDomain, accountNameLength, accountName, pathLength, path, port, protocol, authenticationType, passwordLength, passwordData, itemRef);
+
+	if (status == errSecSuccess) {
+		counts.contents += passwordData != NULL;
+		counts.refs += itemRef != NULL;
+	}
+	return status;
+}
+
+static OSStatus counting_SecKeychainItemCopyContent(SecKeychainItemRef itemRef, SecItemClass* itemClass, SecKeychainAttributeList* attrList, UInt32* length, void** outData) {
+	OSStatus status = SecKeychainItemCopyContent(itemRef, itemClass, attrList, length, outData);
+
+	if (status == errSecSuccess && (attrList != NULL || outData != NULL)) {
+		counts.contents++;
+	}
+	return status;
+}
+
+static OSStatus counting_SecKeychainItemFreeContent(SecKeychainAttributeList* attrList, void* data) {
+	counts.content_frees++;
+	return SecKeychainItemFreeContent(attrList, data);
+}
+
+static OSStatus counting_SecKeychainSearchCreateFromAttributes(CFTypeRef keychainOrArray, SecItemClass itemClass, const SecKeychainAttributeList* attrList, SecKeychainSearchRef* searchRef) {
+	OSStatus status = SecKeychainSearchCreateFromAttributes(keychainOrArray, itemClass, attrList, searchRef);
+
+	if (status == errSecSuccess) {
+		counts.refs++;
+	}
+	return status;
+}
+
+static OSStatus counting_SecKeychainSearchCopyNext(SecKeychainSearchRef searchRef, SecKeychainItemRef* itemRef) {
+	OSStatus status = SecKeychainSearchCopyNext(searchRef, itemRef);
+
+	if (status == errSecSuccess) {
+		counts.refs++;
+	}
+	return status;
+}
+
+/* Counting wrappers for the fakejni functions which allocate. */
+static const jbyte* counting_GetStringUTFChars(void* env, jstring str, jboolean* isCopy) {
+	counts.utf_chars++;
+	return real_env.GetStringUTFChars(env, str, isCopy);
+}
+
+static void counting_ReleaseStringUTFChars(void* env, jstring str, const char* utf) {
+	counts.utf_releases++;
+	real_env.ReleaseStringUTFChars(env, str, utf);
+}
+
+static char* counting_NewStringUTF(void* env, char* str) {
+	counts.new_strings++;
+	return real_env.NewStringUTF(env, str);
+}
+
+static jobject counting_NewObject(void* env, jclass cls, jmethodID methodID, ...) {
+	va_list args;
+	jobject obj;
+
+	counts.new_objects++;
+	va_start(args, methodID);
+	obj = real_env.NewObjectV(env, cls, methodID, args);
+	va_end(args);
+	return obj;
+}
+
+/* Only the native code goes through the counters. */
+#define malloc(size) counting_malloc(size)
+#define calloc(count, size) counting_calloc(count, size)
+#define free(ptr) counting_free(ptr)
+#define CFRelease counting_CFRelease
+#define SecKeychainFindGenericPassword counting_SecKeychainFindGenericPassword
+#define SecKeychainFindInternetPassword counting_SecKeychainFindInternetPassword
+#define SecKeychainItemCopyContent counting_SecKeychainItemCopyContent
+#define SecKeychainItemFreeContent counting_SecKeychainItemFreeContent
+#define SecKeychainSearchCreateFromAttributes counting_SecKeychainSearchCreateFromAttributes
+#define SecKeychainSearchCopyNext counting_SecKeychainSearchCopyNext
+#include "../../src/c/com_mcdermottroe_apple_OSXKeychain.c"
+#undef malloc
+#undef calloc
+#undef free
+#undef CFRelease
+#undef SecKeychainFindGenericPassword
+#undef SecKeychainFindInternetPassword
+#undef SecKeychainItemCopyContent
+#undef SecKeychainItemFreeContent
+#undef SecKeychainSearchCreateFromAttributes
+#undef SecKeychainSearchCopyNext
+
+/* Print a set of counts.
+ *
+ * Parameters:
+ *	label	What the counts are.
+ *	c		The counts.
+ */
+static void print_counts(const char* label, const alloc_counts* c) {
+	printf(
+		"\t%-8s malloc %ld, free %ld, GetStringUTFChars %ld, ReleaseStringUTFChars %ld, NewStringUTF %ld, NewObject %ld, refs %ld, CFRelease %ld, content %ld, FreeContent %ld\n",
+		label,
+		c->mallocs,
+		c->frees,
+		c->utf_chars,
+		c->utf_releases,
+		c->new_strings,
+		c->new_objects,
+		c->refs,
+		c->ref_releases,
+		c->contents,
+		c->content_frees
+	);
+}
+
+/* Check the counts since the last check and exit if they're not exactly
+ * what's expected.
+ *
+ * Parameters:
+ *	operation	The name of the entry point which was called.
+ *	expected	The expected counts.
+ */
+static void expect(const char* operation, alloc_counts expected) {
+	if (memcmp(&counts, &expected, sizeof(alloc_counts)) != 0) {
+		printf("Unexpected allocations in %s.\n", operation);
+		print_counts("expected", &expected);
+		print_counts("actual", &counts);
+		exit(1);
+	}
+	bzero(&counts, sizeof(alloc_counts));
+}
+
+int main(int argc, char** argv) {
+	JNIEnv env;
+	fakejni_env fakejni;
+	long iterations = argc > 1 ? atol(argv[1]) : SOAK_ITERATIONS;
+	long i;
+	jstring password;
+	jlong key;
+	jlong internetKey;
+	jlong handle;
+	char buffer[64];
+	fakejni_list metadata;
+	fakejni_object* object;
+	SecKeychainItemRef item;
+	alloc_counts outstanding;
+
+	fakejni_init(&fakejni);
+	real_env = fakejni;
+	fakejni.GetStringUTFChars = &counting_GetStringUTFChars;
+	fakejni.ReleaseStringUTFChars = &counting_ReleaseStringUTFChars;
+	fakejni.NewStringUTF = &counting_NewStringUTF;
+	fakejni.NewObject = &counting_NewObject;
+	env = &fakejni;
+
+	/* Generic passwords. */
+	Java_com_mcdermottroe_apple_OSXKeychain__1addGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, PASSWORD);
+	expect("addGenericPassword", (alloc_counts){ .utf_chars = 3, .utf_releases = 3 });
+	password = Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPassword(&env, NULL, SERVICE_NAME, USERNAME);
+	expect("findGenericPassword", (alloc_counts){ .mallocs = 1, .frees = 1, .utf_chars = 2, .utf_releases = 2, .new_strings = 1, .contents = 1, .content_frees = 1 });
+	free(password);
+	Java_com_mcdermottroe_apple_OSXKeychain__1modifyGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, NEW_PASSWORD);
+	expect("modifyGenericPassword", (alloc_counts){ .utf_chars = 3, .utf_releases = 3, .refs = 1, .ref_releases = 1 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, NEW_PASSWORD, PASSWORD);
+	expect("compareAndSetGenericPassword", (alloc_counts){ .utf_chars = 4, .utf_releases = 4, .refs = 1, .ref_releases = 1, .contents = 1, .content_frees = 1 });
+
+	/* Prepared generic keys. */
+	key = Java_com_mcdermottroe_apple_OSXKeychain__1prepareGenericKey(&env, NULL, SERVICE_NAME, USERNAME);
+	expect("prepareGenericKey", (alloc_counts){ .mallocs = 1 });
+	password = Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPasswordPrepared(&env, NULL, key);
+	expect("findGenericPasswordPrepared", (alloc_counts){ .mallocs = 1, .frees = 1, .new_strings = 1, .contents = 1, .content_frees = 1 });
+	free(password);
+	Java_com_mcdermottroe_apple_OSXKeychain__1modifyGenericPasswordPrepared(&env, NULL, key, PASSWORD);
+	expect("modifyGenericPasswordPrepared", (alloc_counts){ .utf_chars = 1, .utf_releases = 1, .refs = 1, .ref_releases = 1 });
+
+	/* Streams. */
+	handle = Java_com_mcdermottroe_apple_OSXKeychain__1openSecretReader(&env, NULL, SERVICE_NAME, USERNAME);
+	expect("openSecretReader", (alloc_counts){ .mallocs = 1, .utf_chars = 2, .utf_releases = 2, .contents = 1 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1readSecret(&env, NULL, handle, buffer, 0, sizeof(buffer));
+	expect("readSecret", (alloc_counts){ 0 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1closeSecretReader(&env, NULL, handle);
+	expect("closeSecretReader", (alloc_counts){ .frees = 1, .content_frees = 1 });
+	handle = Java_com_mcdermottroe_apple_OSXKeychain__1openSecretWriter(&env, NULL);
+	expect("openSecretWriter", (alloc_counts){ .mallocs = 1 });
+	memcpy(buffer, NEW_PASSWORD, strlen(NEW_PASSWORD));
+	Java_com_mcdermottroe_apple_OSXKeychain__1writeSecret(&env, NULL, handle, buffer, 0, strlen(NEW_PASSWORD));
+	expect("writeSecret (growing)", (alloc_counts){ .mallocs = 1 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1writeSecret(&env, NULL, handle, buffer, 0, strlen(NEW_PASSWORD));
+	expect("writeSecret", (alloc_counts){ 0 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1commitSecretWriter(&env, NULL, handle, SERVICE_NAME, USERNAME);
+	expect("commitSecretWriter (modify)", (alloc_counts){ .utf_chars = 2, .utf_releases = 2, .refs = 1, .ref_releases = 1 });
+	if (Java_com_mcdermottroe_apple_OSXKeychain__1secretBytesPeak(&env, NULL, JNI_TRUE) < strlen(NEW_PASSWORD) * 2) {
+		printf("The secret writer's buffer was not counted.\n");
+		return 1;
+	}
+	expect("secretBytesPeak", (alloc_counts){ 0 });
+
+	/* Deletion. */
+	Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPasswordPrepared(&env, NULL, key);
+	expect("deleteGenericPasswordPrepared", (alloc_counts){ .refs = 1, .ref_releases = 1 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1commitSecretWriter(&env, NULL, handle, SERVICE_NAME, USERNAME);
+	expect("commitSecretWriter (add)", (alloc_counts){ .utf_chars = 2, .utf_releases = 2 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1freeSecretWriter(&env, NULL, handle);
+	expect("freeSecretWriter", (alloc_counts){ .frees = 2 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPassword(&env, NULL, SERVICE_NAME, USERNAME);
+	expect("deleteGenericPassword", (alloc_counts){ .utf_chars = 2, .utf_releases = 2, .refs = 1, .ref_releases = 1 });
+
+	/* Internet passwords. */
+	Java_com_mcdermottroe_apple_OSXKeychain__1addInternetPassword(&env, NULL, SERVER_NAME, SECURITY_DOMAIN, USERNAME, SERVER_PATH, 443, kSecProtocolTypeHTTPS, kSecAuthenticationTypeDefault, PASSWORD);
+	expect("addInternetPassword", (alloc_counts){ .utf_chars = 5, .utf_releases = 5 });
+	password = Java_com_mcdermottroe_apple_OSXKeychain__1findInternetPassword(&env, NULL, SERVER_NAME, SECURITY_DOMAIN, USERNAME, SERVER_PATH, 443);
+	expect("findInternetPassword", (alloc_counts){ .mallocs = 1, .frees = 1, .utf_chars = 4, .utf_releases = 4, .new_strings = 1, .contents = 1, .content_frees = 1 });
+	free(password);
+	internetKey = Java_com_mcdermottroe_apple_OSXKeychain__1prepareInternetKey(&env, NULL, SERVER_NAME, SECURITY_DOMAIN, USERNAME, SERVER_PATH, 443);
+	expect("prepareInternetKey", (alloc_counts){ .mallocs = 1 });
+	password = Java_com_mcdermottroe_apple_OSXKeychain__1findInternetPasswordPrepared(&env, NULL, internetKey);
+	expect("findInternetPasswordPrepared", (alloc_counts){ .mallocs = 1, .frees = 1, .new_strings = 1, .contents = 1, .content_frees = 1 });
+	free(password);
+	Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetInternetPassword(&env, NULL, SERVER_NAME, SECURITY_DOMAIN, USERNAME, SERVER_PATH, 443, NEW_PASSWORD, NEW_PASSWORD);
+	expect("compareAndSetInternetPassword", (alloc_counts){ .utf_chars = 6, .utf_releases = 6, .refs = 1, .ref_releases = 1, .contents = 1, .content_frees = 1 });
+
+	/* Listing metadata depends on what's in the keychain, so only check
+	 * that everything was released and nothing was copied needlessly.
+	 */
+	Java_com_mcdermottroe_apple_OSXKeychain__1addGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, PASSWORD);
+	bzero(&counts, sizeof(alloc_counts));
+	metadata.size = 0;
+	Java_com_mcdermottroe_apple_OSXKeychain__1listItemMetadata(&env, NULL, &metadata);
+	if (counts.mallocs != counts.frees ||
+		counts.mallocs != counts.new_strings ||
+		counts.utf_chars != 0 ||
+		counts.new_objects != metadata.size ||
+		counts.refs != counts.ref_releases ||
+		counts.contents != counts.content_frees ||
+		counts.contents != metadata.size) {
+		printf("Unexpected allocations in listItemMetadata for %d items.\n", metadata.size);
+		print_counts("actual", &counts);
+		return 1;
+	}
+	bzero(&counts, sizeof(alloc_counts));
+	for (i = 0; i < metadata.size; i++) {
+		object = metadata.items[i];
+		free(object->object_args[1]);
+		free(object->object_args[2]);
+		free(object->object_args[3]);
+		fakejni_free_object(object);
+	}
+
+	/* Events. */
+	keychain_event_post(KEYCHAIN_EVENT_UPDATED, SERVICE_NAME, strlen(SERVICE_NAME), USERNAME, strlen(USERNAME), NULL, 0);
+	expect("keychain_event_post", (alloc_counts){ .mallocs = 3 });
+	object = Java_com_mcdermottroe_apple_OSXKeychain__1takeKeychainEvent(&env, NULL, 0);
+	expect("takeKeychainEvent", (alloc_counts){ .frees = 3, .new_strings = 2, .new_objects = 1 });
+	free(object->object_args[1]);
+	free(object->object_args[2]);
+	fakejni_free_object(object);
+	Java_com_mcdermottroe_apple_OSXKeychain__1takeKeychainEvent(&env, NULL, 0);
+	expect("takeKeychainEvent (empty)", (alloc_counts){ 0 });
+
+	/* Soak the read paths. */
+	printf("Running %ld iterations.\n", iterations);
+	for (i = 0; i < iterations; i++) {
+		free(Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPassword(&env, NULL, SERVICE_NAME, USERNAME));
+		free(Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPasswordPrepared(&env, NULL, key));
+		free(Java_com_mcdermottroe_apple_OSXKeychain__1findInternetPasswordPrepared(&env, NULL, internetKey));
+		Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, NEW_PASSWORD, NEW_PASSWORD);
+		handle = Java_com_mcdermottroe_apple_OSXKeychain__1openSecretReader(&env, NULL, SERVICE_NAME, USERNAME);
+		while (Java_com_mcdermottroe_apple_OSXKeychain__1readSecret(&env, NULL, handle, buffer, 0, sizeof(buffer)) > 0) {
+		}
+		Java_com_mcdermottroe_apple_OSXKeychain__1closeSecretReader(&env, NULL, handle);
+		Java_com_mcdermottroe_apple_OSXKeychain__1takeKeychainEvent(&env, NULL, 0);
+	}
+	print_counts("total", &counts);
+	outstanding.mallocs = counts.mallocs - counts.frees;
+	outstanding.utf_chars = counts.utf_chars - counts.utf_releases;
+	outstanding.refs = counts.refs - counts.ref_releases;
+	outstanding.contents = counts.contents - counts.content_frees;
+	printf(
+		"Outstanding after %ld iterations: %ld allocations, %ld UTF-8 strings, %ld refs, %ld keychain buffers.\n",
+		iterations,
+		outstanding.mallocs,
+		outstanding.utf_chars,
+		outstanding.refs,
+		outstanding.contents
+	);
+	if (outstanding.mallocs != 0 || outstanding.utf_chars != 0 || outstanding.refs != 0 || outstanding.contents != 0) {
+		return 1;
+	}
+	bzero(&counts, sizeof(alloc_counts));
+
+	/* Clean up. */
+	Java_com_mcdermottroe_apple_OSXKeychain__1freePreparedKey(&env, NULL, key);
+	expect("freePreparedKey", (alloc_counts){ .frees = 1 });
+	Java_com_mcdermottroe_apple_OSXKeychain__1freePreparedKey(&env, NULL, internetKey);
+	Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPassword(&env, NULL, SERVICE_NAME, USERNAME);
+	if (SecKeychainFindInternetPassword(NULL, strlen(SERVER_NAME), SERVER_NAME, strlen(SECURITY_DOMAIN), SECURITY_DOMAIN, strlen(USERNAME), USERNAME, strlen(SERVER_PATH), SERVER_PATH, 443, kSecProtocolTypeAny, kSecAuthenticationTypeAny, NULL, NULL, &item) == errSecSuccess) {
+		/* There's no native call for deleting internet passwords. */
+		SecKeychainItemDelete(item);
+		CFRelease(item);
+	}
+	bzero(&counts, sizeof(alloc_counts));
+
+	/* Last, as the callback thread allocates once it's started. */
+	Java_com_mcdermottroe_apple_OSXKeychain__1startKeychainEvents(&env, NULL);
+	expect("startKeychainEvents", (alloc_counts){ 0 });
+
+	return 0;
+}
@@ -24,15 +24,38 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "fakejni.h"
 
+/* A replacement for JNI's (*env)->CallBooleanMethod. Every call is assumed
+ * to be List.add on a fakejni_list.
+ */
+jboolean fakejni_CallBooleanMethod(void* env, jobject obj, jmethodID methodID, ...) {
+	va_list args;
+	fakejni_list* list = (fakejni_list*) obj;
+
+	va_start(args, methodID);
+	if (list->size < sizeof(list->items) / sizeof(list->items[0])) {
+		list->items[list->size++] = va_arg(args, void*);
+	}
+	va_end(args);
+	return JNI_TRUE;
+}
+
 void fakejni_DeleteLocalRef(void *env, jobject lref) {
 }
 
+/* A replacement for JNI's (*env)->ExceptionCheck. Exceptions exit the
+ * program, so there's never one pending.
+ */
+jboolean fakejni_ExceptionCheck(void* env) {
+	return JNI_FALSE;
+}
+
 
 /* A replacement for JNI's (*env)->FindClass. Don't use the result of this
  * function for anything, bad things will happen if you do.
@@ -41,6 +64,23 @@ void* fakejni_FindClass(void* env, const char* exceptionClass) {
 	return (void*)"Don't use this";
 }
 
+/* A replacement for JNI's (*env)->GetByteArrayRegion. */
+void fakejni_GetByteArrayRegion(void* env, jbyteArray array, jsize start, jsize len, jbyte* buf) {
+	memcpy(buf, array + start, len);
+}
+
+/* A replacement for JNI's (*env)->GetMethodID. The method ID is the
+ * signature so that fakejni_NewObject knows how to read its arguments.
+ */
+jmethodID fakejni_GetMethodID(void* env, jclass cls, const char* name, const char* sig) {
+	return sig;
+}
+
+/* A replacement for JNI's (*env)->GetObjectClass. */
+jclass fakejni_GetObjectClass(void* env, jobject obj) {
+	return obj;
+}
+
 /* A replacement for JNI's (*env)->GetStringLength. */
 int fakejni_GetStringLength(void* env, jstring str) {
 	return strlen(str);
@@ -70,6 +110,44 @@ void fakejni_GetStringUTFRegion(void* env, jstring src, int offset, int length,
 	}
 }
 
+/* A replacement for JNI's (*env)->NewObjectV. See fakejni_NewObject. */
+jobject fakejni_NewObjectV(void* env, jclass cls, jmethodID methodID, va_list args) {
+	const char* sig;
+	fakejni_object* obj = (fakejni_object*) calloc(1, sizeof(fakejni_object));
+
+	obj->signature = methodID;
+	for (sig = methodID + 1; *sig != ')' && obj->nargs < FAKEJNI_MAX_ARGS; sig++) {
+		switch (*sig) {
+			case 'J':
+				obj->long_args[obj->nargs++] = va_arg(args, jlong);
+				break;
+			case 'L':
+				obj->object_args[obj->nargs++] = va_arg(args, void*);
+				while (*sig != ';') {
+					sig++;
+				}
+				break;
+			default:
+				obj->int_args[obj->nargs++] = va_arg(args, jint);
+				break;
+		}
+	}
+	return obj;
+}
+
+/* A replacement for JNI's (*env)->NewObject. Returns a fakejni_object
+ * holding the constructor arguments, free it with fakejni_free_object.
+ */
+jobject fakejni_NewObject(void* env, jclass cls, jmethodID methodID, ...) {
+	va_list args;
+	jobject obj;
+
+	va_start(args, methodID);
+	obj = fakejni_NewObjectV(env, cls, methodID, args);
+	va_end(args);
+	return obj;
+}
+
 /* A replacement for JNI's (*env)->NewStringUTF. */
 char* fakejni_NewStringUTF(void* env, char* str) {
 	int len = strlen(str);
@@ -83,21 +161,39 @@ void fakejni_ReleaseStringUTFChars(void *env, jstring string, const char *utf) {
 	free((void *) utf);
 }
 
+/* A replacement for JNI's (*env)->SetByteArrayRegion. */
+void fakejni_SetByteArrayRegion(void* env, jbyteArray array, jsize start, jsize len, const jbyte* buf) {
+	memcpy(array + start, buf, len);
+}
+
 /* A replacement for JNI's (*env)->ThrowNew. */
 void fakejni_ThrowNew(void* env, jclass cls, const char* message) {
 	printf("Exception: %s\n", message);
 	exit(1);
 }
 
+/* Free an object created by fakejni_NewObject. */
+void fakejni_free_object(fakejni_object* obj) {
+	free(obj);
+}
+
 /* Initialise a fakejni_env. */
 void fakejni_init(fakejni_env* env) {
+	env->CallBooleanMethod = &fakejni_CallBooleanMethod;
 	env->DeleteLocalRef = &fakejni_DeleteLocalRef;
+	env->ExceptionCheck = &fakejni_ExceptionCheck;
 	env->FindClass = &fakejni_FindClass;
+	env->GetByteArrayRegion = &fakejni_GetByteArrayRegion;
+	env->GetObjectClass = &fakejni_GetObjectClass;
+	env->GetMethodID = &fakejni_GetMethodID;
 	env->GetStringLength = &fakejni_GetStringLength;
 	env->GetStringUTFRegion = &fakejni_GetStringUTFRegion;
 	env->GetStringUTFChars = &fakejni_GetStringUTFChars;
 	env->GetStringUTFLength = &fakejni_GetStringUTFLength;
+	env->NewObject = &fakejni_NewObject;
+	env->NewObjectV = &fakejni_NewObjectV;
 	env->NewStringUTF = &fakejni_NewStringUTF;
 	env->ReleaseStringUTFChars = fakejni_ReleaseStringUTFChars;
+	env->SetByteArrayRegion = &fakejni_SetByteArrayRegion;
 	env->ThrowNew = &fakejni_ThrowNew;
 }
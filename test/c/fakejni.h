@@ -24,6 +24,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdarg.h>
+
 /* Prevent the real jni.h from being included. */
 #define _JAVASOFT_JNI_H_
 
@@ -35,22 +37,63 @@
 #define jobject void*
 #define jstring char*
 #define jint int
+#define jlong long long
+#define jmethodID const char*
 #define jbyte char
+#define jbyteArray char*
 #define jboolean int
 #define jsize int
+#define JNI_FALSE 0
+#define JNI_TRUE 1
+
+/* The maximum number of constructor arguments fakejni_NewObject records. */
+#define FAKEJNI_MAX_ARGS 8
+
+/* What fakejni_NewObject returns in place of a Java object. The arguments
+ * passed to the constructor are recorded by position in the array matching
+ * their type in the constructor's signature.
+ */
+typedef struct {
+	const char* signature;
+	int nargs;
+	jint int_args[FAKEJNI_MAX_ARGS];
+	jlong long_args[FAKEJNI_MAX_ARGS];
+	void* object_args[FAKEJNI_MAX_ARGS];
+} fakejni_object;
+
+/* Pass one of these wherever native code expects a java.util.List. The
+ * fake CallBooleanMethod assumes every call is List.add and appends to it.
+ */
+typedef struct {
+	int size;
+	void* items[4096];
+} fakejni_list;
 
 /* Something to use as an env* for JNI functions. */
 typedef struct {
+	jboolean (*CallBooleanMethod)(void*, jobject, jmethodID, ...);
 	void (*DeleteLocalRef)(void *env, jobject lref);
+	jboolean (*ExceptionCheck)(void*);
 	void* (*FindClass)(void*, const char*);
+	jclass (*GetObjectClass)(void*, jobject);
+	void (*GetByteArrayRegion)(void*, jbyteArray, jsize, jsize, jbyte*);
+	jmethodID (*GetMethodID)(void*, jclass, const char*, const char*);
 	int (*GetStringLength)(void*, jstring);
 	const jbyte * (*GetStringUTFChars)(void*, jstring, jboolean *);
 	jsize (*GetStringUTFLength)(void *env, jstring string);
 	void (*GetStringUTFRegion)(void*, jstring, int, int, char*);
+	jobject (*NewObject)(void*, jclass, jmethodID, ...);
+	jobject (*NewObjectV)(void*, jclass, jmethodID, va_list);
 	char* (*NewStringUTF)(void*, char*);
 	void (*ReleaseStringUTFChars)(void *env, jstring string, const char *utf);
+	void (*SetByteArrayRegion)(void*, jbyteArray, jsize, jsize, const jbyte*);
 	void (*ThrowNew)(void*, jclass, const char*);
 } fakejni_env;
 
 /* Use this to initialise a fakejni_env. */
 void fakejni_init(fakejni_env*);
+
+/* Free an object returned by fakejni_NewObject. Strings passed to the
+ * constructor are not freed.
+ */
+void fakejni_free_object(fakejni_object*);
@@ -32,11 +32,25 @@
 #define SERVICE_NAME "Test OS X Keychain from Java"
 #define USERNAME "Test OS X Keychain User"
 #define PASSWORD "Test OS X Keychain Password"
+#define NEW_PASSWORD "Test OS X Keychain New Password"
+#define SERVER_NAME "test.osxkeychain.example.com"
+#define SECURITY_DOMAIN "Test OS X Keychain Domain"
+#define SERVER_PATH "/test"
 
 int main() {
 	JNIEnv env;
 	fakejni_env fakejni;
 	jstring genericPassword;
+	fakejni_object* event;
+	jlong preparedKey;
+	jlong secretHandle;
+	char secretChunk[5];
+	char secretBuffer[64];
+	int secretLength;
+	int chunkLength;
+	fakejni_list metadata;
+	fakejni_object* item;
+	SecKeychainItemRef internetItem;
 
 	fakejni_init(&fakejni);
 	env = &fakejni;
@@ -50,5 +64,146 @@ int main() {
 	}
 	Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPassword(&env, NULL, SERVICE_NAME, USERNAME);
 
+	/* Test the same round-trip using a prepared key. */
+	preparedKey = Java_com_mcdermottroe_apple_OSXKeychain__1prepareGenericKey(&env, NULL, SERVICE_NAME, USERNAME);
+	Java_com_mcdermottroe_apple_OSXKeychain__1addGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, PASSWORD);
+	genericPassword = Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPasswordPrepared(&env, NULL, preparedKey);
+	if (strncmp(genericPassword, PASSWORD, strlen(PASSWORD)) != 0) {
+		printf("Failed to round-trip the generic password with a prepared key.\n");
+		return 1;
+	}
+	Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPasswordPrepared(&env, NULL, preparedKey);
+	Java_com_mcdermottroe_apple_OSXKeychain__1freePreparedKey(&env, NULL, preparedKey);
+
+	/* Rotate a password with compare-and-set. */
+	Java_com_mcdermottroe_apple_OSXKeychain__1addGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, PASSWORD);
+	if (Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, NEW_PASSWORD, NEW_PASSWORD)) {
+		printf("Compare-and-set succeeded with the wrong expected password.\n");
+		return 1;
+	}
+	if (!Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, PASSWORD, NEW_PASSWORD)) {
+		printf("Compare-and-set failed with the right expected password.\n");
+		return 1;
+	}
+	genericPassword = Java_com_mcdermottroe_apple_OSXKeychain__1findGenericPassword(&env, NULL, SERVICE_NAME, USERNAME);
+	if (strcmp(genericPassword, NEW_PASSWORD) != 0) {
+		printf("Compare-and-set did not replace the password.\n");
+		return 1;
+	}
+
+	/* Empty passwords are real values, not mismatches. */
+	if (!Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, NEW_PASSWORD, "")) {
+		printf("Compare-and-set failed to set an empty password.\n");
+		return 1;
+	}
+	if (Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, PASSWORD, NEW_PASSWORD)) {
+		printf("Compare-and-set matched a non-empty password against an empty one.\n");
+		return 1;
+	}
+	if (!Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, "", NEW_PASSWORD)) {
+		printf("Compare-and-set failed to match an empty password.\n");
+		return 1;
+	}
+	Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPassword(&env, NULL, SERVICE_NAME, USERNAME);
+
+	/* Rotate an internet password with compare-and-set. */
+	Java_com_mcdermottroe_apple_OSXKeychain__1addInternetPassword(&env, NULL, SERVER_NAME, SECURITY_DOMAIN, USERNAME, SERVER_PATH, 443, kSecProtocolTypeHTTPS, kSecAuthenticationTypeDefault, PASSWORD);
+	if (Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetInternetPassword(&env, NULL, SERVER_NAME, SECURITY_DOMAIN, USERNAME, SERVER_PATH, 443, NEW_PASSWORD, NEW_PASSWORD)) {
+		printf("Internet compare-and-set succeeded with the wrong expected password.\n");
+		return 1;
+	}
+	if (!Java_com_mcdermottroe_apple_OSXKeychain__1compareAndSetInternetPassword(&env, NULL, SERVER_NAME, SECURITY_DOMAIN, USERNAME, SERVER_PATH, 443, PASSWORD, NEW_PASSWORD)) {
+		printf("Internet compare-and-set failed with the right expected password.\n");
+		return 1;
+	}
+	genericPassword = Java_com_mcdermottroe_apple_OSXKeychain__1findInternetPassword(&env, NULL, SERVER_NAME, SECURITY_DOMAIN, USERNAME, SERVER_PATH, 443);
+	if (strcmp(genericPassword, NEW_PASSWORD) != 0) {
+		printf("Internet compare-and-set did not replace the password.\n");
+		return 1;
+	}
+	/* There's no native call for deleting internet passwords. */
+	if (SecKeychainFindInternetPassword(NULL, strlen(SERVER_NAME), SERVER_NAME, strlen(SECURITY_DOMAIN), SECURITY_DOMAIN, strlen(USERNAME), USERNAME, strlen(SERVER_PATH), SERVER_PATH, 443, kSecProtocolTypeAny, kSecAuthenticationTypeAny, NULL, NULL, &internetItem) == errSecSuccess) {
+		SecKeychainItemDelete(internetItem);
+		CFRelease(internetItem);
+	}
+
+	/* Stream a password in and out in small chunks. */
+	secretHandle = Java_com_mcdermottroe_apple_OSXKeychain__1openSecretWriter(&env, NULL);
+	for (secretLength = 0; secretLength < strlen(PASSWORD); secretLength += chunkLength) {
+		chunkLength = strlen(PASSWORD) - secretLength;
+		if (chunkLength > sizeof(secretChunk)) {
+			chunkLength = sizeof(secretChunk);
+		}
+		memcpy(secretChunk, PASSWORD + secretLength, chunkLength);
+		Java_com_mcdermottroe_apple_OSXKeychain__1writeSecret(&env, NULL, secretHandle, secretChunk, 0, chunkLength);
+	}
+	Java_com_mcdermottroe_apple_OSXKeychain__1commitSecretWriter(&env, NULL, secretHandle, SERVICE_NAME, USERNAME);
+	Java_com_mcdermottroe_apple_OSXKeychain__1freeSecretWriter(&env, NULL, secretHandle);
+	secretHandle = Java_com_mcdermottroe_apple_OSXKeychain__1openSecretReader(&env, NULL, SERVICE_NAME, USERNAME);
+	secretLength = 0;
+	while ((chunkLength = Java_com_mcdermottroe_apple_OSXKeychain__1readSecret(&env, NULL, secretHandle, secretChunk, 0, sizeof(secretChunk))) > 0) {
+		memcpy(secretBuffer + secretLength, secretChunk, chunkLength);
+		secretLength += chunkLength;
+	}
+	Java_com_mcdermottroe_apple_OSXKeychain__1closeSecretReader(&env, NULL, secretHandle);
+	if (secretLength != strlen(PASSWORD) || memcmp(secretBuffer, PASSWORD, secretLength) != 0) {
+		printf("Failed to stream the generic password.\n");
+		return 1;
+	}
+	Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPassword(&env, NULL, SERVICE_NAME, USERNAME);
+
+	/* Find the metadata of a generic password. */
+	Java_com_mcdermottroe_apple_OSXKeychain__1addGenericPassword(&env, NULL, SERVICE_NAME, USERNAME, PASSWORD);
+	metadata.size = 0;
+	Java_com_mcdermottroe_apple_OSXKeychain__1listItemMetadata(&env, NULL, &metadata);
+	item = NULL;
+	for (secretLength = 0; secretLength < metadata.size; secretLength++) {
+		if (item == NULL &&
+			((fakejni_object*)metadata.items[secretLength])->int_args[0] == JNI_FALSE &&
+			((fakejni_object*)metadata.items[secretLength])->object_args[1] != NULL &&
+			strcmp(((fakejni_object*)metadata.items[secretLength])->object_args[1], SERVICE_NAME) == 0) {
+			item = metadata.items[secretLength];
+		} else {
+			fakejni_free_object(metadata.items[secretLength]);
+		}
+	}
+	if (item == NULL ||
+		strcmp(item->object_args[2], USERNAME) != 0 ||
+		item->object_args[3] != NULL ||
+		item->long_args[6] <= 0) {
+		printf("Failed to list the generic password metadata.\n");
+		return 1;
+	}
+	fakejni_free_object(item);
+	Java_com_mcdermottroe_apple_OSXKeychain__1deleteGenericPassword(&env, NULL, SERVICE_NAME, USERNAME);
+
+	/* Simulate keychain callbacks and check they come out in order. */
+	keychain_event_post(KEYCHAIN_EVENT_UPDATED, SERVICE_NAME, strlen(SERVICE_NAME), USERNAME, strlen(USERNAME), NULL, 0);
+	keychain_event_post(KEYCHAIN_EVENT_DELETED, NULL, 0, USERNAME, strlen(USERNAME), SERVER_NAME, strlen(SERVER_NAME));
+	event = Java_com_mcdermottroe_apple_OSXKeychain__1takeKeychainEvent(&env, NULL, 0);
+	if (event == NULL ||
+		event->int_args[0] != KEYCHAIN_EVENT_UPDATED ||
+		strcmp(event->object_args[1], SERVICE_NAME) != 0 ||
+		strcmp(event->object_args[2], USERNAME) != 0 ||
+		event->object_args[3] != NULL) {
+		printf("Failed to receive the generic password event.\n");
+		return 1;
+	}
+	fakejni_free_object(event);
+	event = Java_com_mcdermottroe_apple_OSXKeychain__1takeKeychainEvent(&env, NULL, 0);
+	if (event == NULL ||
+		event->int_args[0] != KEYCHAIN_EVENT_DELETED ||
+		event->object_args[1] != NULL ||
+		strcmp(event->object_args[2], USERNAME) != 0 ||
+		strcmp(event->object_args[3], SERVER_NAME) != 0) {
+		printf("Failed to receive the internet password event.\n");
+		return 1;
+	}
+	fakejni_free_object(event);
+	if (Java_com_mcdermottroe_apple_OSXKeychain__1takeKeychainEvent(&env, NULL, 0) != NULL) {
+		printf("Received a keychain event which was never posted.\n");
+		return 1;
+	}
+
 	return 0;
 }
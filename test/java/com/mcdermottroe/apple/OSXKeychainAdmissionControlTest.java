@@ -0,0 +1,115 @@
+package com.mcdermottroe.apple;
+
+import java.util.concurrent.TimeUnit;
+
+import junit.framework.TestCase;
+
+import com.mcdermottroe.apple.OSXKeychainAdmissionControl.Kind;
+
+/** Test the OSXKeychainAdmissionControl class.
+ *
+ *	@author	Conor McDermottroe
+ */
+public class OSXKeychainAdmissionControlTest
+extends TestCase
+{
+	/** A saturated read limit rejects reads but not writes. */
+	public void testConcurrencyLimit()
+	throws OSXKeychainException
+	{
+		OSXKeychainAdmissionControl ac = new OSXKeychainAdmissionControl(1, 0, 1, 0, 0, TimeUnit.MILLISECONDS);
+
+		ac.acquire(Kind.READ);
+		assertEquals(1, ac.getInFlight(Kind.READ));
+		try {
+			ac.acquire(Kind.READ);
+			fail("Admitted a read over the concurrency limit.");
+		} catch (OSXKeychainRejectedException e) {
+			// Expected
+		}
+		assertEquals(1, ac.getRejected(Kind.READ));
+
+		// Writes have their own limit.
+		ac.acquire(Kind.WRITE);
+		ac.release(Kind.WRITE);
+		assertEquals(0, ac.getRejected(Kind.WRITE));
+
+		// Releasing the read lets another in.
+		ac.release(Kind.READ);
+		ac.acquire(Kind.READ);
+		ac.release(Kind.READ);
+		assertEquals(0, ac.getInFlight(Kind.READ));
+		assertEquals(0, ac.getQueued(Kind.READ));
+	}
+
+	/** The rate limit allows a burst, then rejects or waits for a token. */
+	public void testRateLimit()
+	throws OSXKeychainException
+	{
+		OSXKeychainAdmissionControl failFast = new OSXKeychainAdmissionControl(0, 2, 0, 0, 0, TimeUnit.MILLISECONDS);
+		failFast.acquire(Kind.READ);
+		failFast.release(Kind.READ);
+		failFast.acquire(Kind.READ);
+		failFast.release(Kind.READ);
+		try {
+			failFast.acquire(Kind.READ);
+			fail("Admitted a read over the rate limit.");
+		} catch (OSXKeychainRejectedException e) {
+			// Expected
+		}
+
+		OSXKeychainAdmissionControl waiting = new OSXKeychainAdmissionControl(0, 10, 0, 0, 1, TimeUnit.SECONDS);
+		for (int i = 0; i < 12; i++) {
+			waiting.acquire(Kind.READ);
+			waiting.release(Kind.READ);
+		}
+		assertEquals(0, waiting.getRejected(Kind.READ));
+	}
+
+	/** Calls rejected by the concurrency limit don't use up the rate limit. */
+	public void testTokenReturned()
+	throws OSXKeychainException
+	{
+		OSXKeychainAdmissionControl ac = new OSXKeychainAdmissionControl(1, 2, 0, 0, 0, TimeUnit.MILLISECONDS);
+
+		ac.acquire(Kind.READ);
+		for (int i = 0; i < 3; i++) {
+			try {
+				ac.acquire(Kind.READ);
+				fail("Admitted a read over the concurrency limit.");
+			} catch (OSXKeychainRejectedException e) {
+				// Expected
+			}
+		}
+		ac.release(Kind.READ);
+
+		// The second token of the burst is still there.
+		ac.acquire(Kind.READ);
+		ac.release(Kind.READ);
+	}
+
+	/** An interrupted wait is reported as an interruption, not a rejection,
+	 *	and the thread stays interrupted.
+	 */
+	public void testInterrupted()
+	throws OSXKeychainException
+	{
+		OSXKeychainAdmissionControl ac = new OSXKeychainAdmissionControl(1, 0, 0, 0, 10, TimeUnit.SECONDS);
+
+		ac.acquire(Kind.READ);
+		Thread.currentThread().interrupt();
+		try {
+			ac.acquire(Kind.READ);
+			fail("Admitted a read over the concurrency limit.");
+		} catch (OSXKeychainRejectedException e) {
+			fail("Reported an interruption as a rejection.");
+		} catch (OSXKeychainException e) {
+			// Expected
+		} finally {
+			assertTrue("The interrupt flag was not restored.", Thread.interrupted());
+		}
+		assertEquals(0, ac.getRejected(Kind.READ));
+		assertEquals(0, ac.getQueued(Kind.READ));
+		ac.release(Kind.READ);
+	}
+}
@@ -0,0 +1,188 @@
+package com.mcdermottroe.apple;
+
+import java.util.concurrent.BlockingQueue;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.TimeUnit;
+
+import junit.framework.TestCase;
+
+/** Test the delivery of keychain events to listeners, using a simulated
+ *	keychain so that none of these need a real one.
+ *
+ *	@author	Conor McDermottroe
+ */
+public class OSXKeychainEventTest
+extends TestCase
+{
+	/** The events the simulated keychain will emit. */
+	private BlockingQueue<OSXKeychainEvent> posted;
+
+	/** A keychain whose events come from {@link #posted}. */
+	private OSXKeychain keychain;
+
+	/** Create a fresh simulated keychain. */
+	protected void setUp() {
+		posted = new LinkedBlockingQueue<OSXKeychainEvent>();
+		keychain = OSXKeychain.withBackend(new SimulatedBackend(posted));
+	}
+
+	/** Added, updated and deleted events reach every listener in order. */
+	public void testDelivery()
+	throws InterruptedException, OSXKeychainException
+	{
+		BlockingQueue<OSXKeychainEvent> first = new LinkedBlockingQueue<OSXKeychainEvent>();
+		BlockingQueue<OSXKeychainEvent> second = new LinkedBlockingQueue<OSXKeychainEvent>();
+		keychain.addKeychainListener(new QueueingListener(first));
+		keychain.addKeychainListener(new QueueingListener(second));
+
+		post(OSXKeychainEvent.Type.ADDED);
+		post(OSXKeychainEvent.Type.UPDATED);
+		post(OSXKeychainEvent.Type.DELETED);
+
+		assertReceivedAll(first);
+		assertReceivedAll(second);
+	}
+
+	/** A listener which throws an Error has it passed to the uncaught
+	 *	exception handler, and the other listeners still get every event.
+	 */
+	public void testListenerError()
+	throws InterruptedException, OSXKeychainException
+	{
+		final BlockingQueue<Throwable> uncaught = new LinkedBlockingQueue<Throwable>();
+		Thread.UncaughtExceptionHandler previous = Thread.getDefaultUncaughtExceptionHandler();
+		Thread.setDefaultUncaughtExceptionHandler(
+			new Thread.UncaughtExceptionHandler() {
+				public void uncaughtException(Thread thread, Throwable e) {
+					uncaught.add(e);
+				}
+			}
+		);
+		try {
+			BlockingQueue<OSXKeychainEvent> received = new LinkedBlockingQueue<OSXKeychainEvent>();
+			keychain.addKeychainListener(
+				new OSXKeychainListener() {
+					public void keychainChanged(OSXKeychainEvent event) {
+						throw new AssertionError("broken listener");
+					}
+				}
+			);
+			keychain.addKeychainListener(new QueueingListener(received));
+
+			post(OSXKeychainEvent.Type.ADDED);
+			post(OSXKeychainEvent.Type.DELETED);
+
+			assertEquals(OSXKeychainEvent.Type.ADDED, received.poll(5, TimeUnit.SECONDS).getType());
+			assertEquals(OSXKeychainEvent.Type.DELETED, received.poll(5, TimeUnit.SECONDS).getType());
+			assertTrue(uncaught.poll(5, TimeUnit.SECONDS) instanceof AssertionError);
+			assertTrue(uncaught.poll(5, TimeUnit.SECONDS) instanceof AssertionError);
+		} finally {
+			Thread.setDefaultUncaughtExceptionHandler(previous);
+		}
+	}
+
+	/** Check that a listener got one event of each type, in order.
+	 *
+	 *	@param	received	The events the listener got.
+	 *	@throws	InterruptedException	If interrupted while waiting.
+	 */
+	private static void assertReceivedAll(BlockingQueue<OSXKeychainEvent> received)
+	throws InterruptedException
+	{
+		for (OSXKeychainEvent.Type type : OSXKeychainEvent.Type.values()) {
+			OSXKeychainEvent event = received.poll(5, TimeUnit.SECONDS);
+			assertNotNull("No event for " + type + ".", event);
+			assertEquals(type, event.getType());
+			assertEquals("testDelivery_service", event.getServiceName());
+			assertEquals("testDelivery_username", event.getAccountName());
+			assertNull(event.getServerName());
+		}
+	}
+
+	/** Make the simulated keychain emit an event for a generic password.
+	 *
+	 *	@param	type	The kind of change.
+	 */
+	private void post(OSXKeychainEvent.Type type) {
+		posted.add(new OSXKeychainEvent(type.ordinal(), "testDelivery_service", "testDelivery_username", null));
+	}
+
+	/** A listener which keeps every event it's given. */
+	private static final class QueueingListener
+	implements OSXKeychainListener
+	{
+		/** Where the events go. */
+		private final BlockingQueue<OSXKeychainEvent> received;
+
+		/** Create a listener.
+		 *
+		 *	@param	received	Where to put the events.
+		 */
+		QueueingListener(BlockingQueue<OSXKeychainEvent> received) {
+			this.received = received;
+		}
+
+		/** {@inheritDoc} */
+		public void keychainChanged(OSXKeychainEvent event) {
+			received.add(event);
+		}
+	}
+
+	/** A keychain which holds no items and emits the events it's given. */
+	private static final class SimulatedBackend
+	implements OSXKeychain.Backend
+	{
+		/** The events still to be emitted. */
+		private final BlockingQueue<OSXKeychainEvent> events;
+
+		/** Create a simulated keychain.
+		 *
+		 *	@param	events	The events to emit.
+		 */
+		SimulatedBackend(BlockingQueue<OSXKeychainEvent> events) {
+			this.events = events;
+		}
+
+		/** {@inheritDoc} */
+		public void addGenericPassword(String serviceName, String accountName, String password)
+		throws OSXKeychainException
+		{
+			throw new OSXKeychainException("Not simulated.");
+		}
+
+		/** {@inheritDoc} */
+		public void addInternetPassword(String serverName, String securityDomain, String accountName, String path, int port, int protocol, int authenticationType, String password)
+		throws OSXKeychainException
+		{
+			throw new OSXKeychainException("Not simulated.");
+		}
+
+		/** {@inheritDoc} */
+		public String findGenericPassword(String serviceName, String accountName)
+		throws OSXKeychainException
+		{
+			throw new OSXKeychainException("Not simulated.");
+		}
+
+		/** {@inheritDoc} */
+		public String findInternetPassword(String serverName, String securityDomain, String accountName, String path, int port)
+		throws OSXKeychainException
+		{
+			throw new OSXKeychainException("Not simulated.");
+		}
+
+		/** {@inheritDoc} */
+		public void startKeychainEvents() {
+		}
+
+		/** {@inheritDoc} */
+		public OSXKeychainEvent takeKeychainEvent(long timeout) {
+			try {
+				return events.poll(timeout, TimeUnit.MILLISECONDS);
+			} catch (InterruptedException e) {
+				Thread.currentThread().interrupt();
+				return null;
+			}
+		}
+	}
+}
@@ -0,0 +1,162 @@
+package com.mcdermottroe.apple;
+
+import java.io.File;
+import java.io.IOException;
+import java.io.RandomAccessFile;
+import java.util.ArrayList;
+import java.util.List;
+
+import junit.framework.TestCase;
+
+/** Test the OSXKeychainIndex class. None of these touch the keychain.
+ *
+ *	@author	Conor McDermottroe
+ */
+public class OSXKeychainIndexTest
+extends TestCase
+{
+	/** The index file for the current test. */
+	private File file;
+
+	/** Create a fresh index file name. */
+	protected void setUp()
+	throws IOException
+	{
+		file = File.createTempFile("OSXKeychainIndexTest", ".idx");
+		file.delete();
+	}
+
+	/** Remove the index file. */
+	protected void tearDown() {
+		file.delete();
+	}
+
+	/** Prefix and range queries return the right items in name order. */
+	public void testQueries()
+	throws OSXKeychainException
+	{
+		List<OSXKeychainItemMetadata> items = new ArrayList<OSXKeychainItemMetadata>();
+		items.add(new OSXKeychainItemMetadata(false, "com.example.b", "bob", null, 0, 0, 2000L));
+		items.add(new OSXKeychainItemMetadata(true, "example.com", "carol", "/login", 443, 0, 3000L));
+		items.add(new OSXKeychainItemMetadata(false, "com.example.a", "alice", null, 0, 0, 1000L));
+		items.add(new OSXKeychainItemMetadata(false, "com.example", "root", null, 0, 0, 500L));
+		items.add(new OSXKeychainItemMetadata(false, "org.example", "dave", null, 0, 0, 4000L));
+
+		OSXKeychainIndex index = OSXKeychainIndex.write(file, items);
+		assertEquals(5, index.size());
+		assertEquals(4000L, index.getNewestModificationTime());
+
+		List<OSXKeychainItemMetadata> found = index.findByPrefix("com.example.");
+		assertEquals(2, found.size());
+		assertEquals("com.example.a", found.get(0).getServiceName());
+		assertEquals("alice", found.get(0).getAccountName());
+		assertEquals(1000L, found.get(0).getModificationTime());
+		assertEquals("com.example.b", found.get(1).getServiceName());
+
+		assertEquals(3, index.findByPrefix("com.").size());
+		assertEquals(5, index.findByPrefix("").size());
+		assertEquals(0, index.findByPrefix("net.").size());
+
+		found = index.findByRange("com.example.b", "org");
+		assertEquals(2, found.size());
+		assertEquals("com.example.b", found.get(0).getServiceName());
+		assertTrue(found.get(1).isInternetPassword());
+		assertEquals("example.com", found.get(1).getServerName());
+		assertEquals("/login", found.get(1).getPath());
+		assertEquals(443, found.get(1).getPort());
+		assertEquals(1, index.findByRange("org", null).size());
+
+		found = index.findByRange(null, "com.example.b");
+		assertEquals(2, found.size());
+		assertEquals("com.example", found.get(0).getServiceName());
+		assertEquals("com.example.a", found.get(1).getServiceName());
+		assertEquals(5, index.findByRange(null, null).size());
+	}
+
+	/** An index reopened from disk matches what was written and notices
+	 *	when the items change.
+	 */
+	public void testReopen()
+	throws OSXKeychainException
+	{
+		List<OSXKeychainItemMetadata> items = new ArrayList<OSXKeychainItemMetadata>();
+		items.add(new OSXKeychainItemMetadata(false, "service\u00e9", "account", null, 0, 0, 1000L));
+		OSXKeychainIndex.write(file, items);
+
+		OSXKeychainIndex index = OSXKeychain.openIndex(file);
+		assertEquals(1, index.size());
+		assertEquals("service\u00e9", index.get(0).getServiceName());
+		assertTrue(index.isCurrent(items));
+
+		List<OSXKeychainItemMetadata> modified = new ArrayList<OSXKeychainItemMetadata>();
+		modified.add(new OSXKeychainItemMetadata(false, "service\u00e9", "account", null, 0, 0, 2000L));
+		assertFalse(index.isCurrent(modified));
+		assertFalse(index.isCurrent(new ArrayList<OSXKeychainItemMetadata>()));
+	}
+
+	/** Items which differ only by protocol are stored in protocol order, and
+	 *	writing leaves no temporary files behind.
+	 */
+	public void testProtocolOrder()
+	throws OSXKeychainException
+	{
+		List<OSXKeychainItemMetadata> items = new ArrayList<OSXKeychainItemMetadata>();
+		items.add(new OSXKeychainItemMetadata(true, "example.com", "carol", "/", 443, 2, 1000L));
+		items.add(new OSXKeychainItemMetadata(true, "example.com", "carol", "/", 443, 1, 2000L));
+
+		OSXKeychainIndex index = OSXKeychainIndex.write(file, items);
+		assertEquals(1, index.get(0).getProtocolValue());
+		assertEquals(2, index.get(1).getProtocolValue());
+		assertTrue(index.isCurrent(items));
+
+		String[] leftovers = file.getAbsoluteFile().getParentFile().list();
+		for (String name : leftovers) {
+			assertFalse("Left a temporary file behind: " + name, name.startsWith(file.getName()) && name.endsWith(".tmp"));
+		}
+	}
+
+	/** An index whose header is fine but whose record points outside the
+	 *	string area is rejected when it's opened.
+	 */
+	public void testCorruptRecord()
+	throws IOException
+	{
+		List<OSXKeychainItemMetadata> items = new ArrayList<OSXKeychainItemMetadata>();
+		items.add(new OSXKeychainItemMetadata(false, "com.example", "alice", null, 0, 0, 1000L));
+		try {
+			OSXKeychainIndex.write(file, items);
+		} catch (OSXKeychainException e) {
+			fail("Failed to write an index.");
+		}
+
+		// The length of the first record's name: the 32 byte header, then
+		// the 4 byte internet flag and the 4 byte name offset.
+		RandomAccessFile raf = new RandomAccessFile(file, "rw");
+		try {
+			raf.seek(40);
+			raf.writeInt(Integer.MAX_VALUE);
+		} finally {
+			raf.close();
+		}
+
+		try {
+			OSXKeychain.openIndex(file);
+			fail("Opened an index with a record out of bounds.");
+		} catch (OSXKeychainException e) {
+			// Expected
+		}
+	}
+
+	/** Files which are not indexes are rejected. */
+	public void testCorrupt()
+	throws IOException
+	{
+		file.createNewFile();
+		try {
+			OSXKeychain.openIndex(file);
+			fail("Opened an empty file as an index.");
+		} catch (OSXKeychainException e) {
+			// Expected
+		}
+	}
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2011, Conor McDermottroe
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * - Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+package com.mcdermottroe.apple;
+
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.lang.management.ManagementFactory;
+import java.lang.management.MemoryPoolMXBean;
+import java.lang.management.MemoryType;
+
+/** Measure how much memory it takes to move large generic passwords in and
+ *	out of the keychain, comparing the streaming accessors with
+ *	{@link OSXKeychain#findGenericPassword(String, String)}. Run it with
+ *	<code>ant bench</code>. The heap figures are the growth in peak heap usage
+ *	over the baseline for each operation. The native figures are the peak
+ *	bytes held in the streams' native buffers; copies made inside the
+ *	keychain itself are not included.
+ *
+ *	@author	Conor McDermottroe
+ */
+public class OSXKeychainStreamBenchmark {
+	/** The sizes of secret to test, in megabytes. */
+	private static final int[] SIZES_MB = { 1, 16, 64 };
+
+	/** The size of the buffer used to read and write the streams. */
+	private static final int CHUNK_SIZE = 64 * 1024;
+
+	/** The account name used for all of the test passwords. */
+	private static final String ACCOUNT_NAME = "OSXKeychainStreamBenchmark_account";
+
+	/** Run the benchmark.
+	 *
+	 *	@param	args		Ignored.
+	 *	@throws	Exception	If anything goes wrong.
+	 */
+	public static void main(String[] args)
+	throws Exception
+	{
+		OSXKeychain keychain = OSXKeychain.getInstance();
+		byte[] chunk = new byte[CHUNK_SIZE];
+		for (int i = 0; i < chunk.length; i++) {
+			chunk[i] = (byte)('a' + (i % 26));
+		}
+
+		System.out.println("size_mb\tstream_write_kb\tstream_write_native_kb\tstream_read_kb\tstream_read_native_kb\tstring_read_kb");
+		for (int mb : SIZES_MB) {
+			long size = mb * 1024L * 1024L;
+			String serviceName = "OSXKeychainStreamBenchmark_" + mb + "MB";
+
+			// Write it with the stream.
+			long baseline = resetPeakHeap();
+			OSXKeychain.getSecretBytesPeak(true);
+			OutputStream out = keychain.openGenericPasswordOutputStream(serviceName, ACCOUNT_NAME);
+			for (long written = 0; written < size; written += CHUNK_SIZE) {
+				out.write(chunk, 0, (int)Math.min(CHUNK_SIZE, size - written));
+			}
+			out.close();
+			long streamWrite = peakHeap() - baseline;
+			long streamWriteNative = OSXKeychain.getSecretBytesPeak(true);
+
+			// Read it back with the stream.
+			baseline = resetPeakHeap();
+			OSXKeychain.getSecretBytesPeak(true);
+			InputStream in = keychain.openGenericPasswordInputStream(serviceName, ACCOUNT_NAME);
+			long read = 0;
+			int n;
+			while ((n = in.read(chunk)) > 0) {
+				read += n;
+			}
+			in.close();
+			long streamRead = peakHeap() - baseline;
+			long streamReadNative = OSXKeychain.getSecretBytesPeak(true);
+			if (read != size) {
+				throw new IllegalStateException("Read " + read + " bytes, expected " + size);
+			}
+
+			// Read it back as a String for comparison.
+			baseline = resetPeakHeap();
+			String password = keychain.findGenericPassword(serviceName, ACCOUNT_NAME);
+			long stringRead = peakHeap() - baseline;
+			if (password.length() != size) {
+				throw new IllegalStateException("Read " + password.length() + " chars, expected " + size);
+			}
+			password = null;
+
+			keychain.deleteGenericPassword(serviceName, ACCOUNT_NAME);
+			System.out.println(mb + "\t" + (streamWrite / 1024) + "\t" + (streamWriteNative / 1024) + "\t" + (streamRead / 1024) + "\t" + (streamReadNative / 1024) + "\t" + (stringRead / 1024));
+		}
+	}
+
+	/** Collect garbage and reset the peak usage of the heap.
+	 *
+	 *	@return	The heap in use after collecting garbage, in bytes.
+	 */
+	private static long resetPeakHeap() {
+		System.gc();
+		long used = 0;
+		for (MemoryPoolMXBean pool : ManagementFactory.getMemoryPoolMXBeans()) {
+			if (pool.getType() == MemoryType.HEAP) {
+				pool.resetPeakUsage();
+				used += pool.getUsage().getUsed();
+			}
+		}
+		return used;
+	}
+
+	/** Get the peak usage of the heap since the last call to {@link
+	 *	#resetPeakHeap()}.
+	 *
+	 *	@return	The sum of the peak usage of each heap pool, in bytes.
+	 */
+	private static long peakHeap() {
+		long peak = 0;
+		for (MemoryPoolMXBean pool : ManagementFactory.getMemoryPoolMXBeans()) {
+			if (pool.getType() == MemoryType.HEAP) {
+				peak += pool.getPeakUsage().getUsed();
+			}
+		}
+		return peak;
+	}
+}
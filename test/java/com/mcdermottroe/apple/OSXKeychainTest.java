@@ -1,5 +1,17 @@
 package com.mcdermottroe.apple;
 
+import java.io.ByteArrayOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.util.Arrays;
+import java.util.concurrent.BlockingQueue;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.TimeoutException;
+
 import junit.framework.TestCase;
 
 /** Test the OSXKeychainTest class.
@@ -92,6 +104,257 @@ extends TestCase
 		}
 	}
 
+	/** Write and read back a generic password larger than the stream buffer. */
+	public void testStreamGenericPassword()
+	throws IOException
+	{
+		initKeychain();
+
+		final String serviceName = "testStreamGenericPassword_service";
+		final String userName = "testStreamGenericPassword_username";
+		final byte[] password = new byte[100000];
+		for (int i = 0; i < password.length; i++) {
+			password[i] = (byte)('a' + (i % 26));
+		}
+
+		try {
+			OutputStream out = keychain.openGenericPasswordOutputStream(serviceName, userName);
+			for (int i = 0; i < password.length; i += 4096) {
+				out.write(password, i, Math.min(4096, password.length - i));
+			}
+			out.close();
+
+			ByteArrayOutputStream readBack = new ByteArrayOutputStream();
+			InputStream in = keychain.openGenericPasswordInputStream(serviceName, userName);
+			byte[] buffer = new byte[4096];
+			int n;
+			while ((n = in.read(buffer)) > 0) {
+				readBack.write(buffer, 0, n);
+			}
+			in.close();
+			assertTrue("Retrieved password did not match.", Arrays.equals(password, readBack.toByteArray()));
+
+			keychain.deleteGenericPassword(serviceName, userName);
+		} catch (OSXKeychainException e) {
+			fail("Failed to stream a generic password.");
+		}
+	}
+
+	/** Every add and find overload with a timeout throws promptly when the
+	 *	keychain is stuck, hands back its result when the keychain recovers
+	 *	and leaves no worker threads busy afterwards. The keychain is
+	 *	simulated, so this runs anywhere.
+	 */
+	public void testDeadline()
+	throws ExecutionException, InterruptedException, TimeoutException
+	{
+		final CountDownLatch stuck = new CountDownLatch(1);
+		OSXKeychain slow = OSXKeychain.withBackend(new OSXKeychain.Backend() {
+			public void addGenericPassword(String serviceName, String accountName, String password) {
+				await(stuck);
+			}
+
+			public void addInternetPassword(String serverName, String securityDomain, String accountName, String path, int port, int protocol, int authenticationType, String password) {
+				await(stuck);
+			}
+
+			public String findGenericPassword(String serviceName, String accountName) {
+				await(stuck);
+				return "late";
+			}
+
+			public String findInternetPassword(String serverName, String securityDomain, String accountName, String path, int port) {
+				await(stuck);
+				return "late";
+			}
+
+			public void startKeychainEvents() {
+			}
+
+			public OSXKeychainEvent takeKeychainEvent(long timeout) {
+				return null;
+			}
+		});
+
+		try {
+			long timeoutsBefore = slow.getTimeoutCount();
+			OSXKeychainTimeoutException[] timeouts = new OSXKeychainTimeoutException[4];
+			for (int i = 0; i < timeouts.length; i++) {
+				long start = System.nanoTime();
+				try {
+					switch (i) {
+						case 0:
+							slow.addGenericPassword("testDeadline_service", "testDeadline_username", "testDeadline_password", 50, TimeUnit.MILLISECONDS);
+							break;
+						case 1:
+							slow.addInternetPassword("testDeadline.example.com", null, "testDeadline_username", "/", 443, OSXKeychainProtocolType.HTTPS, OSXKeychainAuthenticationType.Any, "testDeadline_password", 50, TimeUnit.MILLISECONDS);
+							break;
+						case 2:
+							slow.findGenericPassword("testDeadline_service", "testDeadline_username", 50, TimeUnit.MILLISECONDS);
+							break;
+						default:
+							slow.findInternetPassword("testDeadline.example.com", null, "testDeadline_username", "/", 443, 50, TimeUnit.MILLISECONDS);
+							break;
+					}
+					fail("A stuck call returned.");
+				} catch (OSXKeychainTimeoutException e) {
+					assertTrue("Took too long to time out.", System.nanoTime() - start < TimeUnit.SECONDS.toNanos(2));
+					timeouts[i] = e;
+				} catch (OSXKeychainException e) {
+					fail("Failed with the wrong exception.");
+				}
+			}
+			assertEquals(timeoutsBefore + timeouts.length, slow.getTimeoutCount());
+
+			stuck.countDown();
+			assertNull(timeouts[0].getLateResult().get(5, TimeUnit.SECONDS));
+			assertNull(timeouts[1].getLateResult().get(5, TimeUnit.SECONDS));
+			assertEquals("late", timeouts[2].getLateResult().get(5, TimeUnit.SECONDS));
+			assertEquals("late", timeouts[3].getLateResult().get(5, TimeUnit.SECONDS));
+
+			long giveUp = System.nanoTime() + TimeUnit.SECONDS.toNanos(5);
+			while (slow.getDeadlineWorkersActive() > 0 && System.nanoTime() < giveUp) {
+				Thread.sleep(10);
+			}
+			assertEquals("Leaked deadline workers.", 0, slow.getDeadlineWorkersActive());
+		} finally {
+			stuck.countDown();
+		}
+	}
+
+	/** Block until a latch opens, keeping the interrupt flag if interrupted.
+	 *
+	 *	@param	latch	The latch to wait for.
+	 */
+	private static void await(CountDownLatch latch) {
+		try {
+			latch.await();
+		} catch (InterruptedException e) {
+			Thread.currentThread().interrupt();
+		}
+	}
+
+	/** Rotate a generic password with compare-and-set. */
+	public void testCompareAndSetGenericPassword() {
+		initKeychain();
+
+		final String serviceName = "testCompareAndSetGenericPassword_service";
+		final String userName = "testCompareAndSetGenericPassword_username";
+		final String password1 = "testCompareAndSetGenericPassword_pw1";
+		final String password2 = "testCompareAndSetGenericPassword_pw2";
+
+		try {
+			keychain.addGenericPassword(serviceName, userName, password1);
+			assertFalse("Swapped from the wrong password.", keychain.compareAndSetGenericPassword(serviceName, userName, password2, password2));
+			assertEquals("Retrieved password did not match.", password1, keychain.findGenericPassword(serviceName, userName));
+			assertTrue("Failed to swap from the right password.", keychain.compareAndSetGenericPassword(serviceName, userName, password1, password2));
+			assertEquals("Retrieved password did not match.", password2, keychain.findGenericPassword(serviceName, userName));
+			keychain.deleteGenericPassword(serviceName, userName);
+		} catch (OSXKeychainException e) {
+			fail("Failed to compare-and-set a generic password.");
+		}
+	}
+
+	/** Try to insert, read and delete a generic password via a prepared key. */
+	public void testPreparedGenericKey() {
+		initKeychain();
+
+		final String serviceName = "testPreparedGenericKey_service";
+		final String userName = "testPreparedGenericKey_username";
+		final String password1 = "testPreparedGenericKey_pw1";
+		final String password2 = "testPreparedGenericKey_pw2";
+
+		OSXKeychainPreparedGenericKey key = null;
+		try {
+			key = keychain.prepareGenericKey(serviceName, userName);
+			keychain.addGenericPassword(serviceName, userName, password1);
+			assertEquals("Retrieved password did not match.", password1, keychain.findGenericPassword(key));
+			keychain.modifyGenericPassword(key, password2);
+			assertEquals("Retrieved password did not match.", password2, keychain.findGenericPassword(key));
+			keychain.deleteGenericPassword(key);
+		} catch (OSXKeychainException e) {
+			fail("Failed to use a prepared key.");
+		} finally {
+			if (key != null) {
+				key.close();
+			}
+		}
+
+		// A closed key must be rejected rather than touching freed memory.
+		assertNotNull("No prepared key was created.", key);
+		try {
+			keychain.findGenericPassword(key);
+			fail("Used a closed prepared key.");
+		} catch (OSXKeychainException e) {
+			// Expected
+		}
+	}
+
+	/** Prepared keys with empty fields would match any item, so they must be
+	 *	rejected.
+	 */
+	public void testPreparedKeyEmptyFields() {
+		initKeychain();
+
+		try {
+			keychain.prepareGenericKey("testPreparedKeyEmptyFields_service", "").close();
+			fail("Prepared a generic key with an empty account name.");
+		} catch (OSXKeychainException e) {
+			// Expected
+		}
+		try {
+			keychain.prepareGenericKey(null, "testPreparedKeyEmptyFields_username").close();
+			fail("Prepared a generic key with a null service name.");
+		} catch (OSXKeychainException e) {
+			// Expected
+		}
+		try {
+			keychain.prepareInternetKey("testPreparedKeyEmptyFields.example.com", null, "user", "/", 0).close();
+			fail("Prepared an internet key with a null security domain.");
+		} catch (OSXKeychainException e) {
+			// Expected
+		}
+	}
+
+	/** Check that adding a generic password notifies keychain listeners. */
+	public void testGenericPasswordEvents()
+	throws InterruptedException
+	{
+		initKeychain();
+
+		final String serviceName = "testGenericPasswordEvents_service";
+		final String userName = "testGenericPasswordEvents_username";
+		final String password = "testGenericPasswordEvents_password";
+		final BlockingQueue<OSXKeychainEvent> events = new LinkedBlockingQueue<OSXKeychainEvent>();
+
+		OSXKeychainListener listener = new OSXKeychainListener() {
+			public void keychainChanged(OSXKeychainEvent event) {
+				if (serviceName.equals(event.getServiceName())) {
+					events.add(event);
+				}
+			}
+		};
+		try {
+			keychain.addKeychainListener(listener);
+			keychain.addGenericPassword(serviceName, userName, password);
+		} catch (OSXKeychainException e) {
+			fail("Failed to add a generic password.");
+		}
+
+		OSXKeychainEvent event = events.poll(5, TimeUnit.SECONDS);
+		assertNotNull("No event for the added password.", event);
+		assertEquals(OSXKeychainEvent.Type.ADDED, event.getType());
+		assertEquals(userName, event.getAccountName());
+
+		// Clean up.
+		keychain.removeKeychainListener(listener);
+		try {
+			keychain.deleteGenericPassword(serviceName, userName);
+		} catch (OSXKeychainException e) {
+			fail("Failed to delete generic password");
+		}
+	}
+
 	/** Initialize the keychain for testing. */
 	private void initKeychain() {
 		try {